@@ -0,0 +1,99 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Core>
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#ifndef PC_EXTRACTOR_H
+#define PC_EXTRACTOR_H
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xf;
+using cv::Mat;
+
+// turns masked depth pixels into 3D points in the camera frame
+class pc_extractor
+{
+    public:
+        // default constructor
+        pc_extractor();
+        // fancy constructor
+        pc_extractor(MatrixXd proj_matrix,
+                     int img_rows,
+                     int img_cols,
+                     double min_depth = 0.0,
+                     double max_depth = 0.0,
+                     int num_of_threads = 1);
+
+        // a pixel gets color label labels[i] if its hsv value falls inside [lower[i], upper[i]]
+        // (inclusive, same convention as cv::inRange); the first matching range wins and 0 means
+        // no match. labels defaults to 1, 2, 3, ... the ranges are baked into a bgr lookup table
+        void set_hsv_thresholds (std::vector<std::vector<int>> lower,
+                                 std::vector<std::vector<int>> upper,
+                                 std::vector<int> labels = {});
+
+        // restrict extraction to the bounding boxes of the projected nodes of each dlo, grown
+        // by margin (meters) around every node. returns false and falls back to the full frame
+        // if any node is behind the camera or does not project to a finite pixel
+        bool set_roi (const MatrixXd& nodes, int nodes_per_dlo, double margin);
+        void clear_roi ();
+        bool has_roi ();
+
+        // points are stored column-wise in a buffer sized for a full frame;
+        // only the first get_num_of_points() columns are valid after extract()
+        int extract (const Mat& mask, const Mat& depth);
+        // fused version: color labeling, occlusion masking and back-projection are done row by row.
+        // the label image (0 = background) is only written out to mask if output_mask is true
+        int extract (const Mat& image,
+                     const Mat& depth,
+                     const Mat& occlusion_mask,
+                     Mat& mask,
+                     bool output_mask = false);
+        const Matrix3Xf& get_points ();
+        // color label of each point (the mask value for the mask-only extract())
+        const std::vector<uchar>& get_labels ();
+        int get_num_of_points ();
+
+    private:
+        MatrixXd proj_matrix_;
+        int img_rows_;
+        int img_cols_;
+        uint16_t min_depth_raw_;
+        uint16_t max_depth_raw_;
+
+        // (u - cx) / fx and (v - cy) / fy, precomputed once per camera
+        std::vector<float> col_coef_;
+        std::vector<float> row_coef_;
+
+        Matrix3Xf pts_;
+        std::vector<uchar> labels_;
+        int num_of_pts_;
+
+        // color label of every bgr value, indexed by (b << 16) | (g << 8) | r
+        std::vector<uchar> color_lut_;
+
+        // column spans [start, end) to process in every row, stored as
+        // spans_[2*k], spans_[2*k+1] for k in [span_offsets_[row], span_offsets_[row+1])
+        bool has_roi_;
+        std::vector<int> span_offsets_;
+        std::vector<int> spans_;
+
+        // the image is split into this many row bands, each processed as one task
+        int num_of_threads_;
+
+        // per-row scratch buffers, one set per band
+        struct row_scratch {
+            std::vector<int> idx;
+            std::vector<uchar> mask_row;
+        };
+        std::vector<row_scratch> scratch_;
+
+        void label_span (const Mat& image, const Mat& occlusion_mask, int row, int col_start, int col_end, uchar* mask_row);
+        int extract_span (const uchar* mask_row, const uint16_t* depth_row, int row, int col_start, int col_end, int* idx, int out_idx);
+        int extract_bands (const std::function<int (int, int, int, row_scratch&, int)>& process_span);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Core>
+#include <vector>
+#include <cstdint>
+#include <limits>
+
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xd;
+using Eigen::RowVector3d;
+
+// uniform hash grid over a fixed N*3 point set for nearest neighbour queries.
+// points are bucketed by cell once; a query walks outward in shells of cells and
+// falls back to a linear scan when the shells would touch more cells than points
+class spatial_index
+{
+    public:
+        // default constructor
+        spatial_index();
+        // fancy constructor
+        spatial_index(const MatrixXd& pts, double cell_size);
+        // same, for points stored as 3 * N
+        spatial_index(const Matrix3Xd& pts, double cell_size);
+
+        int size () const;
+
+        // index of the point closest to query (ties go to the lower index) and its distance.
+        // returns -1 if there is no point within max_dist
+        int nearest (const RowVector3d& query, double& dist,
+                     double max_dist = std::numeric_limits<double>::infinity()) const;
+
+    private:
+        Matrix3Xd pts_;
+        double cell_size_;
+        double inverse_cell_size_;
+
+        // open-addressing table from packed cell coordinates to cell id
+        std::vector<uint64_t> keys_;
+        std::vector<int> cell_ids_;
+        uint64_t capacity_mask_;
+
+        // points of cell c are order_[cell_starts_[c]] ... order_[cell_starts_[c+1] - 1]
+        std::vector<int> cell_starts_;
+        std::vector<int> order_;
+
+        // bounds of the occupied cells
+        int64_t min_cell_[3];
+        int64_t max_cell_[3];
+
+        void build (double cell_size);
+        int64_t cell_coord (double v) const;
+        int find_cell (int64_t ix, int64_t iy, int64_t iz) const;
+        void scan_cell (int cell, const RowVector3d& query, int& best_idx, double& best_dist_sq) const;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <Eigen/Dense>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <Eigen/Sparse>
 #include <vector>
 
 #include <ros/ros.h>
@@ -38,6 +39,7 @@
 #include <thread>
 #include <algorithm> 
 #include <string>
+#include <utility>
 
 #include <unistd.h>
 #include <cstdlib>
@@ -46,6 +48,8 @@
 #include "/home/jingyixiang/gurobi912/linux64/include/gurobi_c++.h"  // personal computer
 // #include <gurobi_c++.h>  // lab computer
 
+#include "voxel_downsampler.h"
+
 #ifndef tracker_H
 #define tracker_H
 
@@ -80,6 +84,36 @@ class tracker
         void initialize_geodesic_coord (std::vector<double> geodesic_coord);
         void initialize_nodes (MatrixXd Y_init);
         void set_sigma2 (double sigma2);
+        // register each dlo against its own subset of points instead of all nodes against all points
+        void set_partition_by_dlo (bool partition_by_dlo);
+        // "cod" (complete orthogonal decomposition), "llt" or "ldlt". the last two solve a symmetric
+        // form of the M step and fall back to cod when it is ill-conditioned
+        void set_m_step_solver (std::string m_step_solver);
+        // if > 0, the E step only evaluates node-point pairs within this many sigmas (geodesic
+        // distance); 0 evaluates all of them
+        void set_e_step_truncation (double e_step_truncation);
+        // runs the E step on float copies of the points and nodes; P1, Pt1 and PX, sigma2 and the
+        // M step stay in double
+        void set_single_precision (bool single_precision);
+        // G and H blocks of a dlo are reused from the last cpd_lle call with the same beta while its
+        // geodesic coordinates and its node positions (relative to their centroid) have moved less
+        // than this; 0 rebuilds them on every call
+        void set_kernel_cache_tolerance (double kernel_cache_tolerance);
+        // squarem: every two em steps are extrapolated and the result is refined by a third step.
+        // the extrapolation is dropped for the plain second step if it lowers the likelihood of
+        // the points. a cycle whose first em step moves the nodes by only a few multiples of tol
+        // is not extrapolated and just keeps that plain step
+        void set_use_em_acceleration (bool use_em_acceleration);
+        // coarse to fine: cpd_lle also downsamples the points to leaf_size * 2, leaf_size * 4, ...
+        // (num_of_levels - 1 coarse levels, leaf_size being that of the points it is given) and
+        // starts on the coarsest level whose leaf size is below sigma. it moves to the next finer
+        // level once sigma drops below the leaf size or the level has converged. 1 disables it
+        void set_multi_resolution (int num_of_levels, double leaf_size);
+        // alpha-beta (alpha = 1) motion model on the nodes: every frame starts from the nodes
+        // moved by their velocities. the velocities take gain times the prediction error and decay
+        // every frame, and are not updated on the first frame after the nodes are initialized;
+        // 0 disables it
+        void set_motion_prediction_gain (double motion_prediction_gain);
 
         bool cpd_lle (MatrixXd X_orig,
                       MatrixXd& Y,
@@ -102,7 +136,8 @@ class tracker
                             std::vector<int> visible_nodes_extended, 
                             MatrixXd proj_matrix, 
                             int img_rows, 
-                            int img_cols);
+                            int img_cols,
+                            std::vector<int> point_labels = {});
 
     private:
         MatrixXd Y_;
@@ -123,14 +158,96 @@ class tracker
         std::vector<double> geodesic_coord_;
         std::vector<MatrixXd> correspondence_priors_;
         double visibility_threshold_;
+        bool partition_by_dlo_;
+        std::string m_step_solver_;
+        double e_step_truncation_;
+        bool single_precision_;
+        double kernel_cache_tolerance_;
+        bool use_em_acceleration_;
+        int num_of_resolution_levels_;
+        double resolution_leaf_size_;
+        // one per coarse level, finest first, so their buffers are reused between calls
+        std::vector<voxel_downsampler> level_downsamplers_;
+        double motion_prediction_gain_;
+        // per-frame node displacements. false until a frame has been registered from already
+        // tracked nodes: the first registration after initialization only aligns them
+        MatrixXd node_velocities_;
+        bool has_node_velocities_;
+
+        // diagonal blocks of G and H built by cpd_lle, with the geodesic coordinates and nodes
+        // they were built from. one entry per beta and block layout
+        struct kernel_cache {
+            double beta;
+            std::vector<int> block_starts;
+            std::vector<double> node_coord;
+            MatrixXd Y_0;
+            std::vector<MatrixXd> G_blocks;
+            std::vector<Eigen::SparseMatrix<double>> H_blocks;
+            // 1 once the llt / ldlt m step has failed on G_blocks[b]; the block then goes straight
+            // to cod until it is rebuilt
+            std::vector<int> spd_failed;
+        };
+        std::vector<kernel_cache> kernel_caches_;
+        // per-dlo trackers of cpd_lle_partitioned, kept so their caches survive between frames.
+        // dlo_tracker_keys_[i] is the {dlo, number of nodes} dlo_trackers_[i] was built for
+        std::vector<tracker> dlo_trackers_;
+        std::vector<std::pair<int, int>> dlo_tracker_keys_;
+
+        // brings the G blocks (and the H blocks if need_H) of the cache entry for beta up to date
+        kernel_cache& update_kernel_cache (const MatrixXd& Y_0,
+                                           const std::vector<double>& node_coord,
+                                           const std::vector<int>& block_starts,
+                                           double beta,
+                                           bool need_H);
 
         std::vector<int> get_nearest_indices (int k, int M, int idx);
-        MatrixXd calc_LLE_weights (int k, MatrixXd X);
+        // sparse LLE weight matrix: every node is reconstructed from at most k (<= 6) neighbours
+        // on its own dlo (a shorter last dlo included), so row i only has entries within k of column i
+        Eigen::SparseMatrix<double> calc_LLE_weights (int k, const MatrixXd& X);
         std::vector<MatrixXd> traverse_geodesic (std::vector<double> geodesic_coord, const MatrixXd guide_nodes, 
                                                  const std::vector<int> visible_nodes, int alignment);
         std::vector<MatrixXd> traverse_euclidean (std::vector<double> geodesic_coord, const MatrixXd guide_nodes, 
                                                   const std::vector<int> visible_nodes, int alignment, int alignment_node_idx = -1);
 
+        // P1, Pt1 and PX of the geodesic membership probabilities, computed tile by tile over the
+        // points (3 * N, one per column) without forming P; entries beyond the truncation are
+        // skipped. every point only gets probabilities on the nodes block_starts[b] ...
+        // block_starts[b+1]-1 of the dlo b of its closest node. returns the log likelihood of the
+        // points, up to a constant
+        template <typename Scalar>
+        double compute_e_step (const Eigen::Matrix<Scalar, 3, Eigen::Dynamic>& X,
+                             const MatrixXd& Y,
+                             double sigma2,
+                             double c,
+                             const std::vector<double>& node_coord,
+                             const std::vector<double>& node_weights,
+                             const std::vector<int>& block_starts,
+                             MatrixXd& P1,
+                             MatrixXd& Pt1,
+                             MatrixXd& PX);
+
+        // assigns every point of X to the dlo of its nearest node in Y_. with color labels,
+        // only dlos whose points mostly share the point's label are considered
+        std::vector<std::vector<int>> partition_points (const MatrixXd& X, const std::vector<int>& point_labels);
+        // runs cpd_lle separately for every dlo; node_dlos[i] is the dlo of Y.row(i)
+        bool cpd_lle_partitioned (const MatrixXd& X_orig,
+                                  const std::vector<std::vector<int>>& partitions,
+                                  const std::vector<int>& node_dlos,
+                                  MatrixXd& Y,
+                                  double& sigma2,
+                                  double beta,
+                                  double lambda,
+                                  double lle_weight,
+                                  double mu,
+                                  int max_iter,
+                                  double tol,
+                                  bool include_lle,
+                                  std::vector<MatrixXd> correspondence_priors = {},
+                                  double alpha = 0,
+                                  std::vector<int> visible_nodes = {},
+                                  double k_vis = 0,
+                                  double visibility_threshold = 0.01);
+
 };
 
 #endif
\ No newline at end of file
@@ -7,6 +7,8 @@
 
 using Eigen::MatrixXd;
 using Eigen::Matrix2Xi;
+using Eigen::RowVector3d;
+using Eigen::Ref;
 using cv::Mat;
 
 void signal_callback_handler(int signum);
@@ -19,14 +21,39 @@ template <typename T> void print_1d_vector (const std::vector<T>& vec) {
     std::cout << std::endl;
 }
 
-double pt2pt_dis_sq (MatrixXd pt1, MatrixXd pt2);
-double pt2pt_dis (MatrixXd pt1, MatrixXd pt2);
+// pt1 and pt2 are single points or sets of points (one per row); the distances of all rows
+// are summed. templated on the expression types so rows and blocks are never copied
+template <typename T1, typename T2> inline double pt2pt_dis_sq (const Eigen::MatrixBase<T1>& pt1, const Eigen::MatrixBase<T2>& pt2) {
+    return (pt1 - pt2).rowwise().squaredNorm().sum();
+}
+template <typename T1, typename T2> inline double pt2pt_dis (const Eigen::MatrixBase<T1>& pt1, const Eigen::MatrixBase<T2>& pt2) {
+    return (pt1 - pt2).rowwise().norm().sum();
+}
+// M * N matrix of squared distances between the rows of Y and the rows of X
+MatrixXd pairwise_sq_dists (const MatrixXd& Y, const MatrixXd& X);
 
 void reg (MatrixXd pts, MatrixXd& Y, double& sigma2, int M, double mu = 0, int max_iter = 50);
 void remove_row(MatrixXd& matrix, unsigned int rowToRemove);
 MatrixXd sort_pts (MatrixXd Y_0);
 
-std::vector<MatrixXd> line_sphere_intersection (MatrixXd point_A, MatrixXd point_B, MatrixXd sphere_center, double radius);
+// single 3d points below are passed as Ref<const RowVector3d>, which binds to rows of a
+// MatrixXd without a heap allocation
+
+// whether x lies in the bounding box of a and b (with a 0.1 mm margin)
+inline bool isBetween (const Ref<const RowVector3d>& x, const Ref<const RowVector3d>& a, const Ref<const RowVector3d>& b) {
+    for (int i = 0; i < 3; i ++) {
+        if (!(a(i)-0.0001 <= x(i) && x(i) <= b(i)+0.0001) &&
+            !(b(i)-0.0001 <= x(i) && x(i) <= a(i)+0.0001)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// intersections of the segment point_A-point_B with the sphere, written to intersections[0 ... n-1].
+// returns n (0, 1 or 2)
+int line_sphere_intersection (const Ref<const RowVector3d>& point_A, const Ref<const RowVector3d>& point_B,
+                              const Ref<const RowVector3d>& sphere_center, double radius, RowVector3d intersections[2]);
 MatrixXd post_processing (MatrixXd Y_0, MatrixXd Y, Matrix2Xi E, MatrixXd initial_template, MatrixXd G);
 MatrixXd cdcpd2_post_processing (MatrixXd Y_0, MatrixXd Y, Matrix2Xi E, MatrixXd initial_template = MatrixXd::Zero(0, 0));
 
@@ -54,7 +81,15 @@ visualization_msgs::MarkerArray MatrixXd2MarkerArray (std::vector<MatrixXd> Y,
                                                       std::vector<float> occluded_node_color = {},
                                                       std::vector<float> occluded_line_color = {});
 
-MatrixXd cross_product (MatrixXd vec1, MatrixXd vec2);
-double dot_product (MatrixXd vec1, MatrixXd vec2);
+inline RowVector3d cross_product (const Ref<const RowVector3d>& vec1, const Ref<const RowVector3d>& vec2) {
+    return vec1.cross(vec2);
+}
+inline double dot_product (const Ref<const RowVector3d>& vec1, const Ref<const RowVector3d>& vec2) {
+    return vec1.dot(vec2);
+}
+
+// closest points on the lines (segments if clamp) a0-a1 and b0-b1 and their distance
+std::tuple<RowVector3d, RowVector3d, double> shortest_dist_between_lines (const Ref<const RowVector3d>& a0, const Ref<const RowVector3d>& a1,
+                                                                          const Ref<const RowVector3d>& b0, const Ref<const RowVector3d>& b1, bool clamp);
 
 #endif
\ No newline at end of file
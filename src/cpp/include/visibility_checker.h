@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Core>
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+#ifndef VISIBILITY_CHECKER_H
+#define VISIBILITY_CHECKER_H
+
+using Eigen::MatrixXd;
+using cv::Mat;
+
+// decides which nodes can be seen by the camera given the last tracking result
+class visibility_checker
+{
+    public:
+        // default constructor
+        visibility_checker();
+        // fancy constructor
+        visibility_checker(MatrixXd proj_matrix,
+                           int nodes_per_dlo,
+                           int dlo_pixel_width);
+
+        // self-occlusion: edges are visited from closest to farthest from the camera and a node is
+        // unoccluded if, the first time it is visited, its pixel is not covered by any edge visited
+        // before. projected edges are dlo_pixel_width wide capsules, tested analytically. nodes on
+        // or behind the camera plane are never unoccluded and their edges cover nothing
+        std::vector<bool> get_self_unoccluded_nodes (const MatrixXd& Y);
+        // whether node i of the Y last passed to the checker is in front of the camera, i.e.
+        // has a pixel
+        bool has_projection (int i) const;
+
+        // node states returned by classify_by_depth
+        static const int VISIBLE = 0;
+        static const int OCCLUDED = 1;
+        static const int MISSING = 2;
+
+        // compares the depth of every node with the aligned depth image (uint16, mm) in a
+        // (2 * window_radius + 1)^2 window around its pixel. a node is visible if any sample is within
+        // depth_tolerance of it, occluded if most samples are in front of it, and missing otherwise
+        // (the surface seen there is behind the node, or there is no depth / the node is off screen)
+        std::vector<int> classify_by_depth (const MatrixXd& Y, const Mat& depth, double depth_tolerance, int window_radius = 2);
+
+    private:
+        MatrixXd proj_matrix_;
+        int nodes_per_dlo_;
+        double half_width_sq_;
+
+        // integer pixel coordinates of every node, as used for drawing. -1 for the nodes that
+        // have no pixel (node_valid_ false)
+        std::vector<int> node_cols_;
+        std::vector<int> node_rows_;
+        std::vector<double> node_depths_;
+        std::vector<bool> node_valid_;
+
+        void project_nodes (const MatrixXd& Y);
+};
+
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Core>
+#include <vector>
+#include <cstdint>
+
+#ifndef VOXEL_DOWNSAMPLER_H
+#define VOXEL_DOWNSAMPLER_H
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xf;
+using Eigen::Matrix3Xd;
+
+// replaces each occupied voxel with the centroid of its points (like pcl::VoxelGrid)
+// using an open-addressing hash table keyed on the voxel index. the table and the
+// accumulators are reused across frames
+class voxel_downsampler
+{
+    public:
+        // default constructor
+        voxel_downsampler();
+        voxel_downsampler(double leaf_size);
+
+        double get_leaf_size ();
+
+        // input: the first num_of_pts columns of pts
+        // output: X in the N*3 layout the tracker uses, voxels in order of first appearance
+        MatrixXd downsample (const Matrix3Xf& pts, int num_of_pts);
+        // same, and each voxel takes the label of its first point
+        MatrixXd downsample (const Matrix3Xf& pts, int num_of_pts, const std::vector<uint8_t>& labels, std::vector<int>& voxel_labels);
+        // all columns of pts (3 * N, one point per column), e.g. to downsample an already
+        // downsampled cloud further
+        MatrixXd downsample (const Matrix3Xd& pts);
+
+    private:
+        double leaf_size_;
+        double inverse_leaf_size_;
+
+        std::vector<uint64_t> keys_;
+        std::vector<int> slots_;
+        uint64_t capacity_mask_;
+
+        // {sum_x, sum_y, sum_z, count} per voxel
+        std::vector<double> sums_;
+        int num_of_voxels_;
+
+        void reset (int num_of_pts);
+        // returns the index of the voxel the point falls into
+        int insert (double x, double y, double z);
+        MatrixXd collect ();
+};
+
+#endif
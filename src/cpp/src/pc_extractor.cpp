@@ -0,0 +1,381 @@
+#include "../include/pc_extractor.h"
+
+#include <ros/ros.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xf;
+using cv::Mat;
+
+pc_extractor::pc_extractor () {
+    img_rows_ = 0;
+    img_cols_ = 0;
+    min_depth_raw_ = 1;
+    max_depth_raw_ = UINT16_MAX;
+    num_of_pts_ = 0;
+    num_of_threads_ = 1;
+    has_roi_ = false;
+}
+
+pc_extractor::pc_extractor (MatrixXd proj_matrix,
+                            int img_rows,
+                            int img_cols,
+                            double min_depth,
+                            double max_depth,
+                            int num_of_threads)
+{
+    proj_matrix_ = proj_matrix;
+    img_rows_ = img_rows;
+    img_cols_ = img_cols;
+
+    // depth images are in millimeters; compare against raw values so that
+    // rejected pixels never get converted. zero depth is always rejected
+    min_depth_raw_ = static_cast<uint16_t>(std::max(1.0, std::min(min_depth * 1000.0, static_cast<double>(UINT16_MAX))));
+    if (max_depth > 0) {
+        max_depth_raw_ = static_cast<uint16_t>(std::min(max_depth * 1000.0, static_cast<double>(UINT16_MAX)));
+    }
+    else {
+        max_depth_raw_ = UINT16_MAX;
+    }
+
+    double fx = proj_matrix(0, 0);
+    double fy = proj_matrix(1, 1);
+    double cx = proj_matrix(0, 2);
+    double cy = proj_matrix(1, 2);
+
+    col_coef_ = std::vector<float>(img_cols);
+    for (int j = 0; j < img_cols; j ++) {
+        col_coef_[j] = static_cast<float>((static_cast<double>(j) - cx) / fx);
+    }
+    row_coef_ = std::vector<float>(img_rows);
+    for (int i = 0; i < img_rows; i ++) {
+        row_coef_[i] = static_cast<float>((static_cast<double>(i) - cy) / fy);
+    }
+
+    // preallocate for the worst case (every pixel valid) so extract() never allocates
+    pts_ = Matrix3Xf::Zero(3, img_rows * img_cols);
+    labels_ = std::vector<uchar>(img_rows * img_cols, 0);
+    num_of_pts_ = 0;
+
+    num_of_threads_ = std::max(1, std::min(num_of_threads, img_rows));
+    scratch_ = std::vector<row_scratch>(num_of_threads_);
+    for (auto& scratch : scratch_) {
+        scratch.idx = std::vector<int>(img_cols);
+        scratch.mask_row = std::vector<uchar>(img_cols);
+    }
+
+    clear_roi();
+}
+
+void pc_extractor::set_hsv_thresholds (std::vector<std::vector<int>> lower,
+                                       std::vector<std::vector<int>> upper,
+                                       std::vector<int> labels)
+{
+    int num_of_ranges = std::min(lower.size(), upper.size());
+    if (labels.size() < num_of_ranges) {
+        for (int i = labels.size(); i < num_of_ranges; i ++) {
+            labels.push_back(i + 1);
+        }
+    }
+
+    // convert every bgr value once; one 256 * 256 slice per blue value keeps the
+    // temporary images small. the conversion is per pixel, so the table matches
+    // cv::cvtColor + cv::inRange exactly
+    color_lut_ = std::vector<uchar>(1 << 24, 0);
+    Mat bgr_slice(256, 256, CV_8UC3);
+    Mat hsv_slice;
+    for (int b = 0; b < 256; b ++) {
+        for (int g = 0; g < 256; g ++) {
+            uchar* bgr = bgr_slice.ptr<uchar>(g);
+            for (int r = 0; r < 256; r ++) {
+                bgr[3*r] = b;
+                bgr[3*r + 1] = g;
+                bgr[3*r + 2] = r;
+            }
+        }
+        cv::cvtColor(bgr_slice, hsv_slice, cv::COLOR_BGR2HSV);
+
+        for (int g = 0; g < 256; g ++) {
+            const uchar* hsv = hsv_slice.ptr<uchar>(g);
+            uchar* lut = color_lut_.data() + (b << 16) + (g << 8);
+            for (int r = 0; r < 256; r ++) {
+                int h = hsv[3*r];
+                int s = hsv[3*r + 1];
+                int v = hsv[3*r + 2];
+                for (int i = 0; i < num_of_ranges; i ++) {
+                    if (h >= lower[i][0] && h <= upper[i][0] &&
+                        s >= lower[i][1] && s <= upper[i][1] &&
+                        v >= lower[i][2] && v <= upper[i][2]) {
+                        lut[r] = static_cast<uchar>(labels[i]);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// pixel coordinate limited to [-1, size], so it always fits an int (a node just in front of
+// the camera projects far outside the image)
+static inline double clamp_pixel (double p, int size) {
+    return std::min(std::max(p, -1.0), static_cast<double>(size));
+}
+
+bool pc_extractor::set_roi (const MatrixXd& nodes, int nodes_per_dlo, double margin) {
+    int num_of_dlos = nodes.rows() / nodes_per_dlo;
+    double fx = proj_matrix_(0, 0);
+    double fy = proj_matrix_(1, 1);
+
+    MatrixXd nodes_h = MatrixXd::Ones(nodes.rows(), 4);
+    nodes_h.leftCols(3) = nodes;
+    MatrixXd image_coords = (proj_matrix_ * nodes_h.transpose()).transpose();
+
+    // one box per dlo
+    std::vector<cv::Rect> rois = {};
+    for (int dlo_idx = 0; dlo_idx < num_of_dlos; dlo_idx ++) {
+        int col_min = img_cols_;
+        int col_max = -1;
+        int row_min = img_rows_;
+        int row_max = -1;
+        for (int i = dlo_idx*nodes_per_dlo; i < (dlo_idx+1)*nodes_per_dlo; i ++) {
+            double z = image_coords(i, 2);
+            if (z <= 0) {
+                clear_roi();
+                return false;
+            }
+            double u = image_coords(i, 0) / z;
+            double v = image_coords(i, 1) / z;
+            // the margin shrinks with depth in pixel space
+            double margin_u = fx * margin / z;
+            double margin_v = fy * margin / z;
+            if (!std::isfinite(u - margin_u) || !std::isfinite(u + margin_u) || !std::isfinite(v - margin_v) || !std::isfinite(v + margin_v)) {
+                clear_roi();
+                return false;
+            }
+
+            col_min = std::min(col_min, static_cast<int>(std::floor(clamp_pixel(u - margin_u, img_cols_))));
+            col_max = std::max(col_max, static_cast<int>(std::ceil(clamp_pixel(u + margin_u, img_cols_))));
+            row_min = std::min(row_min, static_cast<int>(std::floor(clamp_pixel(v - margin_v, img_rows_))));
+            row_max = std::max(row_max, static_cast<int>(std::ceil(clamp_pixel(v + margin_v, img_rows_))));
+        }
+        cv::Rect roi = cv::Rect(col_min, row_min, col_max - col_min + 1, row_max - row_min + 1) & cv::Rect(0, 0, img_cols_, img_rows_);
+        if (roi.area() > 0) {
+            rois.push_back(roi);
+        }
+    }
+
+    // merge the boxes into sorted, non-overlapping column spans for every row
+    span_offsets_.assign(img_rows_ + 1, 0);
+    spans_.clear();
+    std::vector<std::pair<int, int>> row_spans = {};
+    for (int row = 0; row < img_rows_; row ++) {
+        span_offsets_[row] = spans_.size() / 2;
+
+        row_spans.clear();
+        for (auto& roi : rois) {
+            if (row >= roi.y && row < roi.y + roi.height) {
+                row_spans.push_back({roi.x, roi.x + roi.width});
+            }
+        }
+        std::sort(row_spans.begin(), row_spans.end());
+
+        for (auto& span : row_spans) {
+            if (static_cast<int>(spans_.size() / 2) > span_offsets_[row] && span.first <= spans_.back()) {
+                spans_.back() = std::max(spans_.back(), span.second);
+            }
+            else {
+                spans_.push_back(span.first);
+                spans_.push_back(span.second);
+            }
+        }
+    }
+    span_offsets_[img_rows_] = spans_.size() / 2;
+
+    has_roi_ = true;
+    return true;
+}
+
+void pc_extractor::clear_roi () {
+    // the full frame: one span per row
+    span_offsets_ = std::vector<int>(img_rows_ + 1);
+    spans_ = std::vector<int>(2 * img_rows_);
+    for (int row = 0; row < img_rows_; row ++) {
+        span_offsets_[row] = row;
+        spans_[2*row] = 0;
+        spans_[2*row + 1] = img_cols_;
+    }
+    span_offsets_[img_rows_] = img_rows_;
+    has_roi_ = false;
+}
+
+bool pc_extractor::has_roi () {
+    return has_roi_;
+}
+
+const Matrix3Xf& pc_extractor::get_points () {
+    return pts_;
+}
+
+const std::vector<uchar>& pc_extractor::get_labels () {
+    return labels_;
+}
+
+int pc_extractor::get_num_of_points () {
+    return num_of_pts_;
+}
+
+int pc_extractor::extract_span (const uchar* mask_row, const uint16_t* depth_row, int row, int col_start, int col_end, int* idx, int out_idx) {
+    // gather the columns of masked pixels with usable depth. the compaction is
+    // branchless and empty 8-pixel spans of the mask are skipped as one word
+    int count = 0;
+    int j = col_start;
+    for (; j + 8 <= col_end; j += 8) {
+        uint64_t word;
+        std::memcpy(&word, mask_row + j, sizeof(word));
+        if (word == 0) {
+            continue;
+        }
+        for (int k = j; k < j + 8; k ++) {
+            uint16_t d = depth_row[k];
+            idx[count] = k;
+            count += (mask_row[k] != 0 && d >= min_depth_raw_ && d <= max_depth_raw_);
+        }
+    }
+    for (; j < col_end; j ++) {
+        uint16_t d = depth_row[j];
+        idx[count] = j;
+        count += (mask_row[j] != 0 && d >= min_depth_raw_ && d <= max_depth_raw_);
+    }
+
+    // back-project: x = (u - cx) * z / fx, y = (v - cy) * z / fy
+    const float y_coef = row_coef_[row];
+    float* out = pts_.data() + 3*out_idx;
+    uchar* out_labels = labels_.data() + out_idx;
+    for (int k = 0; k < count; k ++) {
+        int col = idx[k];
+        float z = static_cast<float>(depth_row[col]) * 0.001f;
+        out[3*k] = col_coef_[col] * z;
+        out[3*k + 1] = y_coef * z;
+        out[3*k + 2] = z;
+        out_labels[k] = mask_row[col];
+    }
+
+    return count;
+}
+
+void pc_extractor::label_span (const Mat& image, const Mat& occlusion_mask, int row, int col_start, int col_end, uchar* mask_row) {
+    // one table lookup per pixel replaces the hsv conversion and all range checks
+    const uchar* bgr = image.ptr<uchar>(row);
+    const uchar* lut = color_lut_.data();
+    for (int j = col_start; j < col_end; j ++) {
+        mask_row[j] = lut[(bgr[3*j] << 16) | (bgr[3*j + 1] << 8) | bgr[3*j + 2]];
+    }
+
+    if (!occlusion_mask.empty()) {
+        const uchar* occlusion_row = occlusion_mask.ptr<uchar>(row);
+        for (int j = col_start; j < col_end; j ++) {
+            mask_row[j] = (occlusion_row[j] != 0) ? mask_row[j] : 0;
+        }
+    }
+}
+
+int pc_extractor::extract_bands (const std::function<int (int, int, int, row_scratch&, int)>& process_span) {
+    int num_of_bands = num_of_threads_;
+    std::vector<int> band_counts(num_of_bands, 0);
+
+    // a band can never produce more points than it has pixels, so every band writes into
+    // the slice of the buffer starting at its first pixel. no locking is needed
+    auto process_band = [&](int band) {
+        int row_start = band * img_rows_ / num_of_bands;
+        int row_end = (band + 1) * img_rows_ / num_of_bands;
+        int band_out_idx = row_start * img_cols_;
+
+        int count = 0;
+        for (int i = row_start; i < row_end; i ++) {
+            for (int k = span_offsets_[i]; k < span_offsets_[i+1]; k ++) {
+                count += process_span(i, spans_[2*k], spans_[2*k + 1], scratch_[band], band_out_idx + count);
+            }
+        }
+        band_counts[band] = count;
+    };
+
+    if (num_of_bands == 1) {
+        process_band(0);
+    }
+    else {
+        cv::parallel_for_(cv::Range(0, num_of_bands), [&](const cv::Range& range) {
+            for (int band = range.start; band < range.end; band ++) {
+                process_band(band);
+            }
+        }, num_of_bands);
+    }
+
+    // compact the bands in order (prefix sum of the counts) so the point order is the
+    // same as a serial row-major scan regardless of the thread count
+    num_of_pts_ = band_counts[0];
+    for (int band = 1; band < num_of_bands; band ++) {
+        int row_start = band * img_rows_ / num_of_bands;
+        std::memmove(pts_.data() + 3*num_of_pts_, pts_.data() + 3 * row_start * img_cols_, 3 * band_counts[band] * sizeof(float));
+        std::memmove(labels_.data() + num_of_pts_, labels_.data() + row_start * img_cols_, band_counts[band]);
+        num_of_pts_ += band_counts[band];
+    }
+
+    return num_of_pts_;
+}
+
+int pc_extractor::extract (const Mat& mask, const Mat& depth) {
+    num_of_pts_ = 0;
+
+    if (mask.rows != img_rows_ || mask.cols != img_cols_ || depth.rows != img_rows_ || depth.cols != img_cols_) {
+        ROS_ERROR_STREAM("pc_extractor: image size does not match camera info!");
+        return 0;
+    }
+    if (mask.type() != CV_8UC1 || depth.type() != CV_16UC1) {
+        ROS_ERROR_STREAM("pc_extractor: expected a mono8 mask and a 16UC1 depth image!");
+        return 0;
+    }
+
+    return extract_bands([&](int row, int col_start, int col_end, row_scratch& scratch, int out_idx) {
+        return extract_span(mask.ptr<uchar>(row), depth.ptr<uint16_t>(row), row, col_start, col_end, scratch.idx.data(), out_idx);
+    });
+}
+
+int pc_extractor::extract (const Mat& image,
+                           const Mat& depth,
+                           const Mat& occlusion_mask,
+                           Mat& mask,
+                           bool output_mask)
+{
+    num_of_pts_ = 0;
+
+    if (image.rows != img_rows_ || image.cols != img_cols_ || depth.rows != img_rows_ || depth.cols != img_cols_) {
+        ROS_ERROR_STREAM("pc_extractor: image size does not match camera info!");
+        return 0;
+    }
+    if (image.type() != CV_8UC3 || depth.type() != CV_16UC1) {
+        ROS_ERROR_STREAM("pc_extractor: expected a bgr8 image and a 16UC1 depth image!");
+        return 0;
+    }
+    if (!occlusion_mask.empty() && (occlusion_mask.rows != img_rows_ || occlusion_mask.cols != img_cols_ || occlusion_mask.type() != CV_8UC1)) {
+        ROS_ERROR_STREAM("pc_extractor: occlusion mask must be a mono8 image of the same size!");
+        return 0;
+    }
+
+    if (output_mask) {
+        mask.create(img_rows_, img_cols_, CV_8UC1);
+        // pixels outside the roi are never visited
+        if (has_roi_) {
+            mask.setTo(cv::Scalar(0));
+        }
+    }
+
+    return extract_bands([&](int row, int col_start, int col_end, row_scratch& scratch, int out_idx) {
+        uchar* mask_row = output_mask ? mask.ptr<uchar>(row) : scratch.mask_row.data();
+        label_span(image, occlusion_mask, row, col_start, col_end, mask_row);
+        return extract_span(mask_row, depth.ptr<uint16_t>(row), row, col_start, col_end, scratch.idx.data(), out_idx);
+    });
+}
@@ -0,0 +1,212 @@
+#include "../include/spatial_index.h"
+
+#include <algorithm>
+#include <cmath>
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xd;
+using Eigen::RowVector3d;
+
+static const uint64_t EMPTY_KEY = UINT64_MAX;
+
+// cell coordinates are packed into 21 bits per axis, same as voxel_downsampler
+static const int64_t INDEX_OFFSET = int64_t(1) << 20;
+static const uint64_t INDEX_MASK = (uint64_t(1) << 21) - 1;
+
+static inline uint64_t pack_key (int64_t ix, int64_t iy, int64_t iz) {
+    return (static_cast<uint64_t>(ix + INDEX_OFFSET) & INDEX_MASK) |
+           ((static_cast<uint64_t>(iy + INDEX_OFFSET) & INDEX_MASK) << 21) |
+           ((static_cast<uint64_t>(iz + INDEX_OFFSET) & INDEX_MASK) << 42);
+}
+
+static inline uint64_t hash_key (uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+spatial_index::spatial_index () {
+    cell_size_ = 0;
+    inverse_cell_size_ = 0;
+    capacity_mask_ = 0;
+    for (int d = 0; d < 3; d ++) {
+        min_cell_[d] = 0;
+        max_cell_[d] = -1;
+    }
+}
+
+spatial_index::spatial_index (const MatrixXd& pts, double cell_size) {
+    pts_ = pts.transpose();
+    build(cell_size);
+}
+
+spatial_index::spatial_index (const Matrix3Xd& pts, double cell_size) {
+    pts_ = pts;
+    build(cell_size);
+}
+
+void spatial_index::build (double cell_size) {
+    cell_size_ = cell_size;
+    inverse_cell_size_ = 1.0 / cell_size;
+    int N = pts_.cols();
+
+    // keep the load factor at or below 0.5
+    uint64_t capacity = 16;
+    while (capacity < 2 * static_cast<uint64_t>(N)) {
+        capacity <<= 1;
+    }
+    keys_ = std::vector<uint64_t>(capacity, EMPTY_KEY);
+    cell_ids_ = std::vector<int>(capacity, 0);
+    capacity_mask_ = capacity - 1;
+
+    for (int d = 0; d < 3; d ++) {
+        min_cell_[d] = std::numeric_limits<int64_t>::max();
+        max_cell_[d] = std::numeric_limits<int64_t>::min();
+    }
+
+    // assign cell ids in order of first appearance and count the points of each cell
+    std::vector<int> point_cells(N, 0);
+    std::vector<int> cell_counts = {};
+    for (int n = 0; n < N; n ++) {
+        int64_t c[3];
+        for (int d = 0; d < 3; d ++) {
+            c[d] = cell_coord(pts_(d, n));
+            min_cell_[d] = std::min(min_cell_[d], c[d]);
+            max_cell_[d] = std::max(max_cell_[d], c[d]);
+        }
+        uint64_t key = pack_key(c[0], c[1], c[2]);
+
+        // linear probing
+        uint64_t h = hash_key(key) & capacity_mask_;
+        while (keys_[h] != key) {
+            if (keys_[h] == EMPTY_KEY) {
+                keys_[h] = key;
+                cell_ids_[h] = cell_counts.size();
+                cell_counts.push_back(0);
+                break;
+            }
+            h = (h + 1) & capacity_mask_;
+        }
+        point_cells[n] = cell_ids_[h];
+        cell_counts[cell_ids_[h]] += 1;
+    }
+
+    // bucket the point indices by cell, ascending within each cell
+    cell_starts_ = std::vector<int>(cell_counts.size() + 1, 0);
+    for (int c = 0; c < cell_counts.size(); c ++) {
+        cell_starts_[c+1] = cell_starts_[c] + cell_counts[c];
+    }
+    order_ = std::vector<int>(N, 0);
+    std::vector<int> fill = cell_starts_;
+    for (int n = 0; n < N; n ++) {
+        order_[fill[point_cells[n]]] = n;
+        fill[point_cells[n]] += 1;
+    }
+}
+
+int spatial_index::size () const {
+    return pts_.cols();
+}
+
+int64_t spatial_index::cell_coord (double v) const {
+    return static_cast<int64_t>(std::floor(v * inverse_cell_size_));
+}
+
+int spatial_index::find_cell (int64_t ix, int64_t iy, int64_t iz) const {
+    uint64_t key = pack_key(ix, iy, iz);
+    uint64_t h = hash_key(key) & capacity_mask_;
+    while (keys_[h] != EMPTY_KEY) {
+        if (keys_[h] == key) {
+            return cell_ids_[h];
+        }
+        h = (h + 1) & capacity_mask_;
+    }
+    return -1;
+}
+
+void spatial_index::scan_cell (int cell, const RowVector3d& query, int& best_idx, double& best_dist_sq) const {
+    for (int k = cell_starts_[cell]; k < cell_starts_[cell+1]; k ++) {
+        int n = order_[k];
+        double dist_sq = (pts_.col(n).transpose() - query).squaredNorm();
+        if (dist_sq < best_dist_sq || (dist_sq == best_dist_sq && n < best_idx)) {
+            best_dist_sq = dist_sq;
+            best_idx = n;
+        }
+    }
+}
+
+int spatial_index::nearest (const RowVector3d& query, double& dist, double max_dist) const {
+    int N = pts_.cols();
+    // an empty index has no cell bounds (they are left at the int64 extremes)
+    if (N == 0) {
+        return -1;
+    }
+    int best_idx = -1;
+    double best_dist_sq = std::numeric_limits<double>::infinity();
+
+    int64_t c[3];
+    int64_t max_ring = 0;
+    for (int d = 0; d < 3; d ++) {
+        c[d] = cell_coord(query(d));
+        max_ring = std::max(max_ring, std::max(std::abs(c[d] - min_cell_[d]), std::abs(c[d] - max_cell_[d])));
+    }
+
+    // points in shell r are at least (r - 1) * cell_size away from the query
+    int64_t cells_visited = 0;
+    bool done = false;
+    for (int64_t r = 0; r <= max_ring && !done; r ++) {
+        if ((r - 1) * cell_size_ > max_dist) {
+            break;
+        }
+
+        // walking the shells has become more expensive than looking at every point
+        int64_t shell_size = (2*r + 1) * (2*r + 1) * (2*r + 1) - std::max<int64_t>(0, (2*r - 1) * (2*r - 1) * (2*r - 1));
+        if (cells_visited + shell_size > N) {
+            best_idx = -1;
+            best_dist_sq = std::numeric_limits<double>::infinity();
+            for (int n = 0; n < N; n ++) {
+                double dist_sq = (pts_.col(n).transpose() - query).squaredNorm();
+                if (dist_sq < best_dist_sq) {
+                    best_dist_sq = dist_sq;
+                    best_idx = n;
+                }
+            }
+            break;
+        }
+        cells_visited += shell_size;
+
+        int64_t x_start = std::max(c[0] - r, min_cell_[0]), x_end = std::min(c[0] + r, max_cell_[0]);
+        int64_t y_start = std::max(c[1] - r, min_cell_[1]), y_end = std::min(c[1] + r, max_cell_[1]);
+        int64_t z_start = std::max(c[2] - r, min_cell_[2]), z_end = std::min(c[2] + r, max_cell_[2]);
+        for (int64_t ix = x_start; ix <= x_end; ix ++) {
+            for (int64_t iy = y_start; iy <= y_end; iy ++) {
+                bool on_face = (std::abs(ix - c[0]) == r || std::abs(iy - c[1]) == r);
+                // inside the shell only the two z faces belong to it
+                int64_t z_step = (on_face || r == 0) ? 1 : 2*r;
+                for (int64_t iz = on_face ? z_start : c[2] - r; iz <= (on_face ? z_end : c[2] + r); iz += z_step) {
+                    if (iz < z_start || iz > z_end) {
+                        continue;
+                    }
+                    int cell = find_cell(ix, iy, iz);
+                    if (cell != -1) {
+                        scan_cell(cell, query, best_idx, best_dist_sq);
+                    }
+                }
+            }
+        }
+
+        if (best_idx != -1 && std::sqrt(best_dist_sq) < r * cell_size_) {
+            done = true;
+        }
+    }
+
+    if (best_idx == -1 || std::sqrt(best_dist_sq) > max_dist) {
+        return -1;
+    }
+    dist = std::sqrt(best_dist_sq);
+    return best_idx;
+}
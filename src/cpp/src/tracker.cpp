@@ -1,8 +1,13 @@
 #include "../include/utils.h"
 #include "../include/tracker.h"
+#include "../include/spatial_index.h"
+
+#include <opencv2/core/utility.hpp>
 
 using Eigen::MatrixXd;
 using Eigen::RowVectorXd;
+using Eigen::RowVector3d;
+using Eigen::Matrix3Xd;
 using cv::Mat;
 
 tracker::tracker () {}
@@ -26,6 +31,16 @@ tracker::tracker(int num_of_nodes) {
     correspondence_priors_ = {};
     visibility_threshold_ = 0.02;
     nodes_per_dlo_ = num_of_nodes;
+    partition_by_dlo_ = false;
+    m_step_solver_ = "cod";
+    e_step_truncation_ = 0;
+    single_precision_ = false;
+    kernel_cache_tolerance_ = 0;
+    use_em_acceleration_ = false;
+    num_of_resolution_levels_ = 1;
+    resolution_leaf_size_ = 0;
+    motion_prediction_gain_ = 0;
+    has_node_velocities_ = false;
 }
 
 tracker::tracker(int num_of_nodes,
@@ -59,6 +74,16 @@ tracker::tracker(int num_of_nodes,
     tol_ = tol;
     geodesic_coord_ = {};
     correspondence_priors_ = {};
+    partition_by_dlo_ = false;
+    m_step_solver_ = "cod";
+    e_step_truncation_ = 0;
+    single_precision_ = false;
+    kernel_cache_tolerance_ = 0;
+    use_em_acceleration_ = false;
+    num_of_resolution_levels_ = 1;
+    resolution_leaf_size_ = 0;
+    motion_prediction_gain_ = 0;
+    has_node_velocities_ = false;
 }
 
 double tracker::get_sigma2 () {
@@ -86,89 +111,147 @@ void tracker::initialize_geodesic_coord (std::vector<double> geodesic_coord) {
 void tracker::initialize_nodes (MatrixXd Y_init) {
     Y_ = Y_init.replicate(1, 1);
     guide_nodes_ = Y_init.replicate(1, 1);
+    node_velocities_ = MatrixXd::Zero(Y_init.rows(), 3);
+    has_node_velocities_ = false;
 }
 
 void tracker::set_sigma2 (double sigma2) {
     sigma2_ = sigma2;
 }
 
-std::vector<int> tracker::get_nearest_indices (int k, int M, int idx) {
-    std::vector<int> indices_arr;
-    if (idx - k < 0) {
-        for (int i = 0; i <= idx + k; i ++) {
-            if (i != idx) {
-                indices_arr.push_back(i);
-            }
-        }
+void tracker::set_partition_by_dlo (bool partition_by_dlo) {
+    partition_by_dlo_ = partition_by_dlo;
+}
+
+void tracker::set_m_step_solver (std::string m_step_solver) {
+    m_step_solver_ = m_step_solver;
+}
+
+void tracker::set_e_step_truncation (double e_step_truncation) {
+    e_step_truncation_ = e_step_truncation;
+}
+
+void tracker::set_single_precision (bool single_precision) {
+    single_precision_ = single_precision;
+}
+
+void tracker::set_kernel_cache_tolerance (double kernel_cache_tolerance) {
+    kernel_cache_tolerance_ = kernel_cache_tolerance;
+}
+
+void tracker::set_use_em_acceleration (bool use_em_acceleration) {
+    use_em_acceleration_ = use_em_acceleration;
+}
+
+void tracker::set_multi_resolution (int num_of_levels, double leaf_size) {
+    num_of_resolution_levels_ = std::max(1, num_of_levels);
+    resolution_leaf_size_ = leaf_size;
+    level_downsamplers_.clear();
+    if (leaf_size <= 0) {
+        num_of_resolution_levels_ = 1;
     }
-    else if (idx + k >= M) {
-        for (int i = idx - k; i <= M - 1; i ++) {
-            if (i != idx) {
-                indices_arr.push_back(i);
-            }
-        }
+    for (int l = 1; l < num_of_resolution_levels_; l ++) {
+        level_downsamplers_.push_back(voxel_downsampler(leaf_size * pow(2, l)));
     }
-    else {
-        for (int i = idx - k; i <= idx + k; i ++) {
-            if (i != idx) {
-                indices_arr.push_back(i);
-            }
+}
+
+void tracker::set_motion_prediction_gain (double motion_prediction_gain) {
+    motion_prediction_gain_ = motion_prediction_gain;
+}
+
+std::vector<int> tracker::get_nearest_indices (int k, int M, int idx) {
+    // the k nodes on either side of idx, clamped to the M nodes of its dlo
+    std::vector<int> indices_arr;
+    for (int i = std::max(0, idx - k); i <= std::min(M - 1, idx + k); i ++) {
+        if (i != idx) {
+            indices_arr.push_back(i);
         }
     }
 
     return indices_arr;
 }
 
-MatrixXd tracker::calc_LLE_weights (int k, MatrixXd X) {
-    MatrixXd W = MatrixXd::Zero(X.rows(), X.rows());
+Eigen::SparseMatrix<double> tracker::calc_LLE_weights (int k, const MatrixXd& X) {
+    // at most 6 neighbours, so the local matrices live on the stack
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, 6, 6> MatrixLLE;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, 6, 1> VectorLLE;
+
+    std::vector<Eigen::Triplet<double>> triplets = {};
+    triplets.reserve(X.rows() * k);
     for (int i = 0; i < X.rows(); i ++) {
 
         int dlo_index = i / nodes_per_dlo_;
         int offset = dlo_index * nodes_per_dlo_;
 
-        std::vector<int> indices = get_nearest_indices(static_cast<int>(k/2), nodes_per_dlo_, i-offset);
+        // the last dlo of X can be shorter than nodes_per_dlo_ (e.g. occluded guide nodes)
+        int dlo_size = std::min(nodes_per_dlo_, static_cast<int>(X.rows()) - offset);
+        std::vector<int> indices = get_nearest_indices(static_cast<int>(k/2), dlo_size, i-offset);
         for (int idx = 0; idx < indices.size(); idx ++) {
             indices[idx] += offset;
         }
 
-        MatrixXd xi = X.row(i);
-        MatrixXd Xi = MatrixXd(indices.size(), X.cols());
-
-        // fill in Xi: Xi = X[indices, :]
+        // component = np.full((len(Xi), len(xi)), xi).T - Xi.T
+        Eigen::Matrix<double, 3, Eigen::Dynamic, 0, 3, 6> component(3, indices.size());
         for (int r = 0; r < indices.size(); r ++) {
-            Xi.row(r) = X.row(indices[r]);
+            component.col(r) = (X.row(i) - X.row(indices[r])).transpose();
         }
+        MatrixLLE Gi = component.transpose() * component;
 
-        // component = np.full((len(Xi), len(xi)), xi).T - Xi.T
-        MatrixXd component = xi.replicate(Xi.rows(), 1).transpose() - Xi.transpose();
-        MatrixXd Gi = component.transpose() * component;
-        MatrixXd Gi_inv;
-
-        if (Gi.determinant() != 0) {
-            Gi_inv = Gi.inverse();
-        }
-        else {
+        Eigen::PartialPivLU<MatrixLLE> Gi_lu(Gi);
+        if (Gi_lu.determinant() == 0) {
             // std::cout << "Gi singular at entry " << i << std::endl;
             double epsilon = 0.00001;
             Gi.diagonal().array() += epsilon;
-            Gi_inv = Gi.inverse();
+            Gi_lu.compute(Gi);
         }
 
         // wi = Gi_inv * 1 / (1^T * Gi_inv * 1)
-        MatrixXd ones_row_vec = MatrixXd::Constant(1, Xi.rows(), 1.0);
-        MatrixXd ones_col_vec = MatrixXd::Constant(Xi.rows(), 1, 1.0);
-
-        MatrixXd wi = (Gi_inv * ones_col_vec) / (ones_row_vec * Gi_inv * ones_col_vec).value();
-        MatrixXd wi_T = wi.transpose();
+        VectorLLE wi = Gi_lu.solve(VectorLLE::Ones(indices.size()));
+        wi /= wi.sum();
 
         for (int c = 0; c < indices.size(); c ++) {
-            W(i, indices[c]) = wi_T(c);
+            triplets.push_back(Eigen::Triplet<double>(i, indices[c], wi(c)));
         }
     }
 
+    Eigen::SparseMatrix<double> W(X.rows(), X.rows());
+    W.setFromTriplets(triplets.begin(), triplets.end());
     return W;
 }
 
+// below this reciprocal condition number the symmetric system is too ill-conditioned
+// (usually a very smooth kernel, i.e. a large beta) and the M step falls back to cod
+static const double MIN_M_STEP_RCOND = 1e-12;
+
+// longest squarem extrapolation, in units of the plain em step
+static const double MAX_SQUAREM_STEP = 4.0;
+// squarem only extrapolates while the first plain step of a cycle moves the nodes by more than
+// this many times tol (per node, as in the convergence test). closer to convergence the two
+// extra em steps of a cycle cost more than the extrapolation saves
+static const double MIN_SQUAREM_RESIDUAL = 2.0;
+
+// A W = B with A = (diag(P1) + sigma2*lle_weight*H + alpha*J) G + lambda*sigma2*I is not symmetric,
+// but G A = G (...) G + lambda*sigma2*G is, and it is positive definite for a positive definite G.
+// solves G A W = G B with llt or ldlt; returns false if the factorization fails or is ill-conditioned
+static bool solve_m_step_spd (const MatrixXd& G, const MatrixXd& A, const MatrixXd& B, bool use_llt, MatrixXd& W) {
+    MatrixXd K = G * A;
+    if (use_llt) {
+        Eigen::LLT<MatrixXd> llt(K);
+        if (llt.info() != Eigen::Success || llt.rcond() < MIN_M_STEP_RCOND) {
+            return false;
+        }
+        W = llt.solve(G * B);
+    }
+    else {
+        Eigen::LDLT<MatrixXd> ldlt(K);
+        if (ldlt.info() != Eigen::Success || !ldlt.isPositive() || ldlt.rcond() < MIN_M_STEP_RCOND) {
+            return false;
+        }
+        W = ldlt.solve(G * B);
+    }
+    return W.allFinite();
+}
+
 bool tracker::cpd_lle (MatrixXd X_orig,
                         MatrixXd& Y,
                         double& sigma2,
@@ -187,279 +270,709 @@ bool tracker::cpd_lle (MatrixXd X_orig,
 {
     int num_of_dlos = Y.rows() / nodes_per_dlo_;
 
-    // prune X
-    MatrixXd X_temp = MatrixXd::Zero(X_orig.rows(), 3);
+    // prune X. the points are stored as 3 * N from here on so every point is one contiguous column
+    Matrix3Xd X_orig_cols = X_orig.transpose();
+    Matrix3Xd X(3, X_orig.rows());
     int valid_pt_counter = 0;
-    for (int i = 0; i < X_orig.rows(); i ++) {
+    // with 0.1 m cells only the 27 cells around a point can hold a node close enough
+    spatial_index Y_index(Y, 0.1);
+    for (int i = 0; i < X_orig_cols.cols(); i ++) {
         // find shortest distance between this point and any node
         double shortest_dist = 100000;
-        for (int j = 0; j < Y.rows(); j ++) {
-            double dist = (Y.row(j) - X_orig.row(i)).norm();
-            if (dist < shortest_dist) {
-                shortest_dist = dist;
-            }
-        }
+        Y_index.nearest(X_orig_cols.col(i).transpose(), shortest_dist, 0.1);
         // require a point to be sufficiently close to the node set to be valid
         if (shortest_dist < 0.1) {
-            X_temp.row(valid_pt_counter) = X_orig.row(i);
+            X.col(valid_pt_counter) = X_orig_cols.col(i);
             valid_pt_counter += 1;
         }
     }
-    MatrixXd X = X_temp.topRows(valid_pt_counter);
+    X.conservativeResize(3, valid_pt_counter);
+    // the points never change during the em iterations, so the float copy is made once
+    Eigen::Matrix3Xf X_float;
+    if (single_precision_) {
+        X_float = X.cast<float>();
+    }
 
-    bool converged = true;
+    bool converged = false;
 
     int M = Y.rows();
-    int N = X.rows();
+    int N = X.cols();
     int D = 3;
 
     MatrixXd Y_0 = Y.replicate(1, 1);
 
-    MatrixXd diff_yy = MatrixXd::Zero(M, M);
-    MatrixXd diff_yy_sqrt = MatrixXd::Zero(M, M);
-    for (int i = 0; i < M; i ++) {
-        for (int j = 0; j < M; j ++) {
-            diff_yy(i, j) = (Y_0.row(i) - Y_0.row(j)).squaredNorm();
-            diff_yy_sqrt(i, j) = (Y_0.row(i) - Y_0.row(j)).norm();
-        }
-    }
-
-    MatrixXd converted_node_dis = MatrixXd::Zero(M, M); // this is a M*M matrix in place of diff_sqrt
-    MatrixXd converted_node_dis_sq = MatrixXd::Zero(M, M);
     std::vector<double> converted_node_coord = {0.0};   // this is not squared
-
-    MatrixXd G = MatrixXd::Zero(M, M);
     double cur_sum = 0;
     for (int i = 0; i < M-1; i ++) {
         cur_sum += pt2pt_dis(Y_0.row(i+1), Y_0.row(i));
         converted_node_coord.push_back(cur_sum);
     }
 
-    for (int i = 0; i < converted_node_coord.size(); i ++) {
-        for (int j = 0; j < converted_node_coord.size(); j ++) {
-            converted_node_dis_sq(i, j) = pow(converted_node_coord[i] - converted_node_coord[j], 2);
-            converted_node_dis(i, j) = abs(converted_node_coord[i] - converted_node_coord[j]);
-        }
-    }
-
-    // kernel matrix
-    G = 1/(2*beta * 2*beta) * (-sqrt(2)*converted_node_dis/beta).array().exp() * (2*converted_node_dis.array() + sqrt(2)*beta);
-
-    // tracking multiple dlos
+    // node ranges of the diagonal blocks of G: one per dlo, plus the leftover nodes if M
+    // is not a multiple of nodes_per_dlo_
+    std::vector<int> block_starts = {0};
     if (num_of_dlos > 1) {
-        MatrixXd G_new = MatrixXd::Zero(M, M);
-        for (int i = 0; i < num_of_dlos; i ++) {
-            int start = i * nodes_per_dlo_;
-            G_new.block(start, start, nodes_per_dlo_, nodes_per_dlo_) = G.block(start, start, nodes_per_dlo_, nodes_per_dlo_);
+        for (int i = 1; i <= num_of_dlos; i ++) {
+            block_starts.push_back(i * nodes_per_dlo_);
         }
-        G = G_new.replicate(1, 1);
+    }
+    if (block_starts.back() != M) {
+        block_starts.push_back(M);
     }
 
-    // get the LLE matrix
-    MatrixXd L = calc_LLE_weights(6, Y_0);
-    MatrixXd H = (MatrixXd::Identity(M, M) - L).transpose() * (MatrixXd::Identity(M, M) - L);
+    // kernel matrix G and LLE matrix H, kept as their diagonal blocks
+    kernel_cache& kernel = update_kernel_cache(Y_0, converted_node_coord, block_starts, beta, include_lle);
 
-    // construct J
-    MatrixXd J = MatrixXd::Zero(M, M);
+    // construct J. J is diagonal with a 1 for every node that has a correspondence prior, so it
+    // is kept as the sorted list of those nodes
+    std::vector<int> prior_nodes = {};
     MatrixXd Y_extended = Y_0.replicate(1, 1);
-    if (correspondence_priors.size() != 0) {
-        int num_of_correspondence_priors = correspondence_priors.size();
-
-        for (int i = 0; i < num_of_correspondence_priors; i ++) {
-            MatrixXd temp = MatrixXd::Zero(1, 3);
-            int index = correspondence_priors[i](0, 0);
-            temp(0, 0) = correspondence_priors[i](0, 1);
-            temp(0, 1) = correspondence_priors[i](0, 2);
-            temp(0, 2) = correspondence_priors[i](0, 3);
+    for (int i = 0; i < correspondence_priors.size(); i ++) {
+        int index = correspondence_priors[i](0, 0);
+        prior_nodes.push_back(index);
+        Y_extended.row(index) = correspondence_priors[i].block(0, 1, 1, 3);
+    }
+    std::sort(prior_nodes.begin(), prior_nodes.end());
+    prior_nodes.erase(std::unique(prior_nodes.begin(), prior_nodes.end()), prior_nodes.end());
 
-            J.row(index) = MatrixXd::Identity(M, M).row(index);
-            Y_extended.row(index) = temp;
+    // the E step streams over the points and never forms M * N matrices. the closest point
+    // of every node (for P_vis) comes from an index over X, which is fixed during the call
+    spatial_index X_index(X, 0.02);
 
-            // // enforce boundaries
-            // if (i == 0 || i == num_of_correspondence_priors-1) {
-            //     J.row(index) *= 5;
-            // }
-        }
+    // initialize sigma2: sum of |y_m - x_n|^2 over all pairs, expanded
+    if (sigma2 == 0) {
+        double sum_of_sq_dists = N * Y_0.squaredNorm() + M * X.squaredNorm() - 2 * Y_0.colwise().sum().dot(X.rowwise().sum().transpose());
+        sigma2 = sum_of_sq_dists / static_cast<double>(D * M * N);
     }
 
-    // diff_xy should be a (M * N) matrix
-    MatrixXd diff_xy = MatrixXd::Zero(M, N);
-    for (int i = 0; i < M; i ++) {
-        for (int j = 0; j < N; j ++) {
-            diff_xy(i, j) = (Y_0.row(i) - X.row(j)).squaredNorm();
+    // coarse to fine: level l > 0 holds the points downsampled to resolution_leaf_size_ * 2^l.
+    // a level is only worth running while the gmm is wider than its voxels, so the first level
+    // is the coarsest one whose leaf size is still below sigma
+    int level = 0;
+    while (level + 1 < num_of_resolution_levels_ && level_downsamplers_[level].get_leaf_size() <= sqrt(sigma2)) {
+        level += 1;
+    }
+    std::vector<Matrix3Xd> X_coarse(level);
+    std::vector<Eigen::Matrix3Xf> X_coarse_float(level);
+    for (int l = 1; l <= level; l ++) {
+        X_coarse[l-1] = level_downsamplers_[l-1].downsample(X).transpose();
+        if (single_precision_) {
+            X_coarse_float[l-1] = X_coarse[l-1].cast<float>();
         }
     }
+    int num_of_coarse_em_steps = 0;
+
+    // which M-step path was taken, for the logs
+    int num_of_solves = 0;
+    int num_of_cholesky_solves = 0;
+    int num_of_rejected_extrapolations = 0;
+
+    // log posterior of nodes Y_in = Y_0 + G W_in and sigma2_in, up to a constant: the log likelihood
+    // of the points minus the terms the M step penalizes (coherence, lle and correspondence priors)
+    auto log_posterior = [&](double log_likelihood, const MatrixXd& Y_in, const MatrixXd& W_in, double sigma2_in) {
+        // tr(W^T G W) = tr(W^T (Y - Y_0))
+        double value = log_likelihood - lambda/2 * (W_in.transpose() * (Y_in - Y_0)).trace();
+        if (include_lle) {
+            for (int b = 0; b < block_starts.size()-1; b ++) {
+                MatrixXd Y_b = Y_in.middleRows(block_starts[b], block_starts[b+1] - block_starts[b]);
+                value -= lle_weight/2 * (Y_b.transpose() * (kernel.H_blocks[b] * Y_b)).trace();
+            }
+        }
+        for (int j : prior_nodes) {
+            value -= alpha/(2*sigma2_in) * (Y_in.row(j) - Y_extended.row(j)).squaredNorm();
+        }
+        return value;
+    };
+
+    // one em step from (Y_in, W_in, sigma2_in) to (T, W, sigma2_out). returns the log posterior
+    // of the input
+    int num_of_em_steps = 0;
+    auto em_step = [&](const MatrixXd& Y_in, const MatrixXd& W_in, double sigma2_in, MatrixXd& T, MatrixXd& W, double& sigma2_out) {
+        num_of_em_steps += 1;
+        if (level > 0) {
+            num_of_coarse_em_steps += 1;
+        }
+        const Matrix3Xd& X_l = (level > 0) ? X_coarse[level-1] : X;
+        int N_l = X_l.cols();
 
-    // initialize sigma2
-    if (sigma2 == 0) {
-        sigma2 = diff_xy.sum() / static_cast<double>(D * M * N);
-    }
+        MatrixXd Pt1;
+        MatrixXd P1;
+        MatrixXd PX;
 
-    for (int it = 0; it < max_iter; it ++) {
-
-        // update diff_xy
-        std::map<int, double> shortest_node_pt_dists;
-        for (int m = 0; m < M; m ++) {
-            // for each node in Y, determine a point in X closest to it
-            // for P_vis calculations
-            double shortest_dist = 10000;
-            for (int n = 0; n < N; n ++) {
-                diff_xy(m, n) = (Y.row(m) - X.row(n)).squaredNorm();
-                double dist = (Y.row(m) - X.row(n)).norm();
-                if (dist < shortest_dist) {
-                    shortest_dist = dist;
+        // for P_vis calculations: distance from each node to its closest point
+        std::vector<double> node_weights(M, 1.0);
+        double c = pow((2 * M_PI * sigma2_in), static_cast<double>(D)/2) * mu / (1 - mu) * static_cast<double>(M)/N_l;
+        if (visible_nodes.size() != Y_in.rows() && !visible_nodes.empty() && k_vis != 0) {
+            double total_P_vis = 0;
+            for (int m = 0; m < M; m ++) {
+                double shortest_dist = 10000;
+                X_index.nearest(Y_in.row(m), shortest_dist);
+                // if close enough to X, the node is visible
+                if (shortest_dist <= visibility_threshold) {
+                    shortest_dist = 0;
                 }
+                node_weights[m] = exp(-k_vis * shortest_dist);
+                total_P_vis += node_weights[m];
             }
-            // if close enough to X, the node is visible
-            if (shortest_dist <= visibility_threshold) {
-                shortest_dist = 0;
+            for (int m = 0; m < M; m ++) {
+                node_weights[m] /= total_P_vis;
             }
-            // push back the pair
-            shortest_node_pt_dists.insert(std::pair<int, double>(m, shortest_dist));
+            c = pow((2 * M_PI * sigma2_in), static_cast<double>(D)/2) * mu / (1 - mu) / N_l;
         }
 
-        MatrixXd P = (-0.5 * diff_xy / sigma2).array().exp();
-        MatrixXd P_stored = P.replicate(1, 1);
-        double c = pow((2 * M_PI * sigma2), static_cast<double>(D)/2) * mu / (1 - mu) * static_cast<double>(M)/N;
-        P = P.array().rowwise() / (P.colwise().sum().array() + c);
+        double log_likelihood = 0;
+        if (single_precision_) {
+            log_likelihood = compute_e_step<float>((level > 0) ? X_coarse_float[level-1] : X_float, Y_in, sigma2_in, c, converted_node_coord, node_weights, block_starts, P1, Pt1, PX);
+        }
+        else {
+            log_likelihood = compute_e_step<double>(X_l, Y_in, sigma2_in, c, converted_node_coord, node_weights, block_starts, P1, Pt1, PX);
+        }
+        double Np = P1.sum();
 
-        // P matrix calculation based on geodesic distance
-        std::vector<int> max_p_nodes(P.cols(), 0);
-        MatrixXd pts_dis_sq_geodesic = MatrixXd::Zero(M, N);
+        // M step
+        // G, H and J only couple nodes of the same dlo, so A is block diagonal with one
+        // block per dlo and every block is solved on its own
+        W = MatrixXd::Zero(M, D);
+        MatrixXd GW = MatrixXd::Zero(M, D);
+        std::vector<int> cholesky_solves(block_starts.size()-1, 0);
+        cv::parallel_for_(cv::Range(0, block_starts.size()-1), [&](const cv::Range& range) {
+            for (int b = range.start; b < range.end; b ++) {
+                int start = block_starts[b];
+                int size = block_starts[b+1] - start;
+                const MatrixXd& G_b = kernel.G_blocks[b];
+                MatrixXd P1_b = P1.middleRows(start, size);
+                MatrixXd Y_0_b = Y_0.middleRows(start, size);
+
+                MatrixXd A_matrix = P1_b.asDiagonal()*G_b;
+                A_matrix.diagonal().array() += lambda*sigma2_in;
+                MatrixXd B_matrix = PX.middleRows(start, size) - P1_b.asDiagonal()*Y_0_b;
+                if (include_lle) {
+                    const Eigen::SparseMatrix<double>& H_b = kernel.H_blocks[b];
+                    A_matrix += sigma2_in*lle_weight * (H_b*G_b);
+                    B_matrix -= sigma2_in*lle_weight * (H_b*Y_0_b);
+                }
+                // J G and J (Y_extended - Y_0) are only nonzero on the rows of the prior nodes
+                for (auto it = std::lower_bound(prior_nodes.begin(), prior_nodes.end(), start);
+                     it != prior_nodes.end() && *it < start + size; it ++) {
+                    A_matrix.row(*it - start) += alpha*G_b.row(*it - start);
+                    B_matrix.row(*it - start) += alpha*(Y_extended.row(*it) - Y_0.row(*it));
+                }
 
-        // loop through all points
-        for (int i = 0; i < N; i ++) {
-            
-            P.col(i).maxCoeff(&max_p_nodes[i]);
-            int max_p_node = max_p_nodes[i];
+                MatrixXd W_b;
+                // the conditioning of G A is dominated by G, so a block that failed once (e.g. the
+                // smooth pre-processing kernel) is not factorized again
+                if ((m_step_solver_ == "llt" || m_step_solver_ == "ldlt") && !kernel.spd_failed[b]) {
+                    cholesky_solves[b] = solve_m_step_spd(G_b, A_matrix, B_matrix, m_step_solver_ == "llt", W_b);
+                    kernel.spd_failed[b] = !cholesky_solves[b];
+                }
+                if (!cholesky_solves[b]) {
+                    W_b = A_matrix.completeOrthogonalDecomposition().solve(B_matrix);
+                }
 
-            int potential_2nd_max_p_node_1 = max_p_node - 1;
-            if (potential_2nd_max_p_node_1 == -1) {
-                potential_2nd_max_p_node_1 = 2;
+                W.middleRows(start, size) = W_b;
+                GW.middleRows(start, size) = G_b * W_b;
             }
+        }, block_starts.size()-1);
+        num_of_solves += cholesky_solves.size();
+        num_of_cholesky_solves += std::count(cholesky_solves.begin(), cholesky_solves.end(), 1);
 
-            int potential_2nd_max_p_node_2 = max_p_node + 1;
-            if (potential_2nd_max_p_node_2 == M) {
-                potential_2nd_max_p_node_2 = M - 3;
-            }
+        T = Y_0 + GW;
+        double trXtdPt1X = X_l.colwise().squaredNorm().dot(Pt1.row(0));
+        double trPXtT = (PX.transpose() * T).trace();
+        double trTtdP1T = (T.transpose() * P1.asDiagonal() * T).trace();
 
-            int next_max_p_node;
-            if (pt2pt_dis(Y.row(potential_2nd_max_p_node_1), X.row(i)) < pt2pt_dis(Y.row(potential_2nd_max_p_node_2), X.row(i))) {
-                next_max_p_node = potential_2nd_max_p_node_1;
-            } 
-            else {
-                next_max_p_node = potential_2nd_max_p_node_2;
-            }
+        sigma2_out = (trXtdPt1X - 2*trPXtT + trTtdP1T) / (Np * D);
 
-            // fill the current column of pts_dis_sq_geodesic
-            pts_dis_sq_geodesic(max_p_node, i) = pt2pt_dis_sq(Y.row(max_p_node), X.row(i));
-            pts_dis_sq_geodesic(next_max_p_node, i) = pt2pt_dis_sq(Y.row(next_max_p_node), X.row(i));
+        return log_posterior(log_likelihood, Y_in, W_in, sigma2_in);
+    };
 
-            if (max_p_node < next_max_p_node) {
-                for (int j = 0; j < max_p_node; j ++) {
-                    pts_dis_sq_geodesic(j, i) = pow(abs(converted_node_coord[j] - converted_node_coord[max_p_node]) + pt2pt_dis(Y.row(max_p_node), X.row(i)), 2);
-                }
-                for (int j = next_max_p_node; j < M; j ++) {
-                    pts_dis_sq_geodesic(j, i) = pow(abs(converted_node_coord[j] - converted_node_coord[next_max_p_node]) + pt2pt_dis(Y.row(next_max_p_node), X.row(i)), 2);
+    // the nodes moved less than tol in the last em step
+    auto has_converged = [&](const MatrixXd& Y_in, const MatrixXd& T) {
+        return pt2pt_dis(Y_in, T) / M < tol;
+    };
+
+    MatrixXd W = MatrixXd::Zero(M, D);
+    while (num_of_em_steps < max_iter && !(converged && level == 0)) {
+        // a coarse level is left once it has converged or sigma has dropped below its leaf size.
+        // the log posteriors of different levels are not comparable, so this only happens
+        // between squarem cycles
+        if (level > 0 && converged) {
+            level -= 1;
+            converged = false;
+        }
+        while (level > 0 && sqrt(sigma2) < level_downsamplers_[level-1].get_leaf_size()) {
+            level -= 1;
+        }
+
+        MatrixXd Y_1, W_1;
+        double sigma2_1;
+        em_step(Y, W, sigma2, Y_1, W_1, sigma2_1);
+        converged = has_converged(Y, Y_1);
+        bool near_convergence = (pt2pt_dis(Y, Y_1) / M < MIN_SQUAREM_RESIDUAL * tol);
+        if (converged || !use_em_acceleration_ || near_convergence || num_of_em_steps >= max_iter) {
+            Y = Y_1;
+            W = W_1;
+            sigma2 = sigma2_1;
+            continue;
+        }
+
+        MatrixXd Y_2, W_2;
+        double sigma2_2;
+        double log_posterior_1 = em_step(Y_1, W_1, sigma2_1, Y_2, W_2, sigma2_2);
+        converged = has_converged(Y_1, Y_2);
+        if (converged || num_of_em_steps >= max_iter) {
+            Y = Y_2;
+            W = W_2;
+            sigma2 = sigma2_2;
+            continue;
+        }
+
+        // squarem: extrapolate W (and with it Y = Y_0 + G W) and sigma2 along the first and
+        // second differences of the two plain steps. the step length is at least 1 (which gives
+        // back the second plain step) and at most MAX_SQUAREM_STEP
+        MatrixXd r = Y_1 - Y;
+        MatrixXd v = Y_2 - Y_1 - r;
+        double step_length = (v.norm() > 0) ? r.norm() / v.norm() : 1.0;
+        step_length = std::min(MAX_SQUAREM_STEP, std::max(1.0, step_length));
+        if (step_length == 1.0) {
+            Y = Y_2;
+            W = W_2;
+            sigma2 = sigma2_2;
+            continue;
+        }
+        MatrixXd Y_x = Y + 2*step_length*r + step_length*step_length*v;
+        MatrixXd W_x = W + 2*step_length*(W_1 - W) + step_length*step_length*(W_2 - 2*W_1 + W);
+        double sigma2_x = sigma2 + 2*step_length*(sigma2_1 - sigma2) + step_length*step_length*(sigma2_2 - 2*sigma2_1 + sigma2);
+        if (sigma2_x <= 0) {
+            sigma2_x = sigma2_2;
+        }
+
+        // one plain step from the extrapolated point keeps it stable. it is kept only if the
+        // extrapolated point has at least the log posterior of the first plain step
+        MatrixXd Y_3, W_3;
+        double sigma2_3;
+        double log_posterior_x = em_step(Y_x, W_x, sigma2_x, Y_3, W_3, sigma2_3);
+        if (log_posterior_x >= log_posterior_1) {
+            converged = has_converged(Y_x, Y_3);
+            Y = Y_3;
+            W = W_3;
+            sigma2 = sigma2_3;
+        }
+        else {
+            num_of_rejected_extrapolations += 1;
+            Y = Y_2;
+            W = W_2;
+            sigma2 = sigma2_2;
+        }
+    }
+
+    // only the full resolution counts
+    converged = converged && level == 0;
+    if (converged) {
+        ROS_INFO_STREAM("Iteration until convergence: " + std::to_string(num_of_em_steps));
+    }
+    else {
+        ROS_ERROR("optimization did not converge!");
+    }
+    if (use_em_acceleration_ && num_of_rejected_extrapolations > 0) {
+        ROS_INFO_STREAM("EM: " + std::to_string(num_of_rejected_extrapolations) + " squarem extrapolations rejected");
+    }
+    if (num_of_coarse_em_steps > 0) {
+        ROS_INFO_STREAM("EM: " + std::to_string(num_of_coarse_em_steps) + " of " + std::to_string(num_of_em_steps) + " steps on coarse levels");
+    }
+
+    if (m_step_solver_ != "cod") {
+        ROS_INFO_STREAM("M-step: " + std::to_string(num_of_cholesky_solves) + " of " + std::to_string(num_of_solves) + " block solves used "
+                        + m_step_solver_ + ", the rest used cod");
+    }
+    
+    return converged;
+}
+
+tracker::kernel_cache& tracker::update_kernel_cache (const MatrixXd& Y_0,
+                                                     const std::vector<double>& node_coord,
+                                                     const std::vector<int>& block_starts,
+                                                     double beta,
+                                                     bool need_H)
+{
+    int M = Y_0.rows();
+    int num_of_dlos = M / nodes_per_dlo_;
+
+    int entry = -1;
+    for (int i = 0; i < kernel_caches_.size(); i ++) {
+        if (kernel_caches_[i].beta == beta && kernel_caches_[i].block_starts == block_starts) {
+            entry = i;
+        }
+    }
+    if (entry == -1) {
+        kernel_cache new_cache;
+        new_cache.beta = beta;
+        new_cache.block_starts = block_starts;
+        new_cache.node_coord = node_coord;
+        new_cache.Y_0 = Y_0;
+        new_cache.G_blocks = std::vector<MatrixXd>(block_starts.size()-1);
+        new_cache.H_blocks = std::vector<Eigen::SparseMatrix<double>>(block_starts.size()-1);
+        new_cache.spd_failed = std::vector<int>(block_starts.size()-1, 0);
+        // cpd_lle is called with one beta for pre-processing and one for tracking
+        if (kernel_caches_.size() >= 4) {
+            kernel_caches_.erase(kernel_caches_.begin());
+        }
+        kernel_caches_.push_back(new_cache);
+        entry = kernel_caches_.size() - 1;
+    }
+    kernel_cache& cache = kernel_caches_[entry];
+
+    for (int b = 0; b < block_starts.size()-1; b ++) {
+        int start = block_starts[b];
+        int size = block_starts[b+1] - start;
+
+        // G: compare the geodesic coordinates relative to the first node of the block
+        bool G_valid = (kernel_cache_tolerance_ > 0 && cache.G_blocks[b].rows() == size);
+        for (int i = 0; i < size && G_valid; i ++) {
+            double cur = node_coord[start+i] - node_coord[start];
+            double cached = cache.node_coord[start+i] - cache.node_coord[start];
+            G_valid = (fabs(cur - cached) <= kernel_cache_tolerance_);
+        }
+        if (!G_valid) {
+            MatrixXd converted_node_dis = MatrixXd::Zero(size, size); // this is a size*size block in place of diff_sqrt
+            for (int i = 0; i < size; i ++) {
+                for (int j = 0; j < size; j ++) {
+                    converted_node_dis(i, j) = fabs(node_coord[start+i] - node_coord[start+j]);
                 }
             }
-            else {
-                for (int j = 0; j < next_max_p_node; j ++) {
-                    pts_dis_sq_geodesic(j, i) = pow(abs(converted_node_coord[j] - converted_node_coord[next_max_p_node]) + pt2pt_dis(Y.row(next_max_p_node), X.row(i)), 2);
-                }
-                for (int j = max_p_node; j < M; j ++) {
-                    pts_dis_sq_geodesic(j, i) = pow(abs(converted_node_coord[j] - converted_node_coord[max_p_node]) + pt2pt_dis(Y.row(max_p_node), X.row(i)), 2);
-                }
+            cache.G_blocks[b] = 1/(2*beta * 2*beta) * (-sqrt(2)*converted_node_dis/beta).array().exp() * (2*converted_node_dis.array() + sqrt(2)*beta);
+            // with several dlos, the leftover nodes are not coupled by G
+            if (num_of_dlos > 1 && start == num_of_dlos * nodes_per_dlo_) {
+                cache.G_blocks[b].setZero();
+            }
+            for (int i = start; i < start + size; i ++) {
+                cache.node_coord[i] = node_coord[i];
             }
+            cache.spd_failed[b] = 0;
         }
 
-        // update P
-        P = (-0.5 * pts_dis_sq_geodesic / sigma2).array().exp();
+        if (!need_H) {
+            continue;
+        }
 
-        
-        // modified membership probability (adapted from cdcpd)
-        if (visible_nodes.size() != Y.rows() && !visible_nodes.empty() && k_vis != 0) {
-            MatrixXd P_vis = MatrixXd::Ones(P.rows(), P.cols());
-            double total_P_vis = 0;
+        // H: compare the node positions relative to the centroid of the block
+        bool H_valid = (kernel_cache_tolerance_ > 0 && cache.H_blocks[b].rows() == size);
+        if (H_valid) {
+            MatrixXd cur = Y_0.middleRows(start, size).rowwise() - Y_0.middleRows(start, size).colwise().mean();
+            MatrixXd cached = cache.Y_0.middleRows(start, size).rowwise() - cache.Y_0.middleRows(start, size).colwise().mean();
+            H_valid = ((cur - cached).rowwise().norm().maxCoeff() <= kernel_cache_tolerance_);
+        }
+        if (!H_valid) {
+            // blocks start at multiples of nodes_per_dlo_, so the lle neighbourhoods of the block
+            // are the same as in the full matrix. they never reach past the end of the block
+            Eigen::SparseMatrix<double> I_minus_L(size, size);
+            I_minus_L.setIdentity();
+            I_minus_L -= calc_LLE_weights(6, Y_0.middleRows(start, size));
+            // banded: (I - L)^T (I - L) couples nodes at most 2k apart
+            cache.H_blocks[b] = (I_minus_L.transpose() * I_minus_L).pruned();
+            cache.Y_0.middleRows(start, size) = Y_0.middleRows(start, size);
+        }
+    }
+
+    return cache;
+}
 
-            for (int i = 0; i < Y.rows(); i ++) {
-                double shortest_node_pt_dist = shortest_node_pt_dists[i];
+template <typename Scalar>
+double tracker::compute_e_step (const Eigen::Matrix<Scalar, 3, Eigen::Dynamic>& X,
+                              const MatrixXd& Y,
+                              double sigma2,
+                              double c,
+                              const std::vector<double>& node_coord,
+                              const std::vector<double>& node_weights,
+                              const std::vector<int>& block_starts,
+                              MatrixXd& P1,
+                              MatrixXd& Pt1,
+                              MatrixXd& PX)
+{
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> ArrayXs;
 
-                double P_vis_i = exp(-k_vis * shortest_node_pt_dist);
-                total_P_vis += P_vis_i;
+    int M = Y.rows();
+    int N = X.cols();
+    double cutoff = (e_step_truncation_ > 0) ? e_step_truncation_ * sqrt(sigma2) : std::numeric_limits<double>::infinity();
+
+    P1 = MatrixXd::Zero(M, 1);
+    Pt1 = MatrixXd::Zero(1, N);
+    PX = MatrixXd::Zero(M, X.rows());
+
+    // nodes move every iteration, so the index is rebuilt; cells match the cutoff
+    Matrix3Xd Y_cols = Y.transpose();
+    spatial_index Y_index(Y_cols, std::min(std::max(cutoff, 0.001), 0.1));
+
+    // block (dlo) of every node
+    std::vector<int> node_blocks(M, 0);
+    for (int b = 0; b < block_starts.size()-1; b ++) {
+        for (int j = block_starts[b]; j < block_starts[b+1]; j ++) {
+            node_blocks[j] = b;
+        }
+    }
 
-                P_vis.row(i) = P_vis_i * P_vis.row(i);
+    // per-node inputs and the P entries in Scalar; the reductions are accumulated in double
+    ArrayXs coords = Eigen::Map<const Eigen::ArrayXd>(node_coord.data(), M).template cast<Scalar>();
+    ArrayXs weights = Eigen::Map<const Eigen::ArrayXd>(node_weights.data(), M).template cast<Scalar>();
+
+    // points are processed in tiles whose P entries fit in about 64 KB. a point only belongs to
+    // the dlo of its closest node, and along that dlo its geodesic distance grows away from its
+    // two closest nodes, so the nodes within the cutoff form one contiguous range per point:
+    // point i of the tile covers nodes first_nodes[i] ... with values values[starts[i]] ...
+    // c carries the gaussian normalization (2 pi sigma2)^(D/2), so the log likelihood is the sum of
+    // log(column sum + c) minus N (D/2) log(2 pi sigma2)
+    double log_likelihood = 0;
+
+    int tile_size = std::max(1, 8192 / std::max(M, 1));
+    std::vector<int> starts(tile_size+1, 0);
+    std::vector<int> first_nodes(tile_size, 0);
+    std::vector<Scalar> values = {};
+    values.reserve(static_cast<size_t>(tile_size) * M);
+
+    for (int tile_start = 0; tile_start < N; tile_start += tile_size) {
+        int tile_end = std::min(N, tile_start + tile_size);
+        values.clear();
+
+        for (int i = tile_start; i < tile_end; i ++) {
+            int start = values.size();
+            starts[i - tile_start] = start;
+            first_nodes[i - tile_start] = 0;
+
+            Eigen::Vector3d x = X.col(i).template cast<double>();
+            double max_p_dist;
+            int max_p_node = Y_index.nearest(x.transpose(), max_p_dist, cutoff);
+            // every entry of this column is beyond the cutoff
+            if (max_p_node == -1) {
+                log_likelihood += log(c);
+                continue;
+            }
+            int block_start = block_starts[node_blocks[max_p_node]];
+            int block_end = block_starts[node_blocks[max_p_node] + 1];
+
+            // the closer of the two neighbours of max_p_node on the same dlo
+            int next_max_p_node = max_p_node;
+            double next_max_p_dist = max_p_dist;
+            if (max_p_node - 1 >= block_start) {
+                next_max_p_node = max_p_node - 1;
+                next_max_p_dist = (Y_cols.col(max_p_node - 1) - x).norm();
+            }
+            if (max_p_node + 1 < block_end) {
+                double dist = (Y_cols.col(max_p_node + 1) - x).norm();
+                if (next_max_p_node == max_p_node || dist <= next_max_p_dist) {
+                    next_max_p_node = max_p_node + 1;
+                    next_max_p_dist = dist;
+                }
             }
 
-            // normalize P_vis
-            P_vis = P_vis / total_P_vis;
+            int lo = std::min(max_p_node, next_max_p_node);
+            int hi = std::max(max_p_node, next_max_p_node);
+            double lo_dist = (lo == max_p_node) ? max_p_dist : next_max_p_dist;
+            double hi_dist = (hi == max_p_node) ? max_p_dist : next_max_p_dist;
 
-            // modify P
-            P = P.cwiseProduct(P_vis);
+            // grow the range away from both nodes while the geodesic distance stays within the cutoff
+            int first = (lo_dist < cutoff) ? lo : lo + 1;
+            while (first > block_start && node_coord[lo] - node_coord[first-1] + lo_dist < cutoff) {
+                first -= 1;
+            }
+            int last = (hi_dist < cutoff) ? hi : hi - 1;
+            while (last < block_end-1 && node_coord[last+1] - node_coord[hi] + hi_dist < cutoff) {
+                last += 1;
+            }
+            if (last < first) {
+                log_likelihood += log(c);
+                continue;
+            }
+
+            // nodes up to lo measure from lo, nodes from hi on measure from hi
+            first_nodes[i - tile_start] = first;
+            values.resize(start + last - first + 1);
+            Eigen::Map<ArrayXs> p(values.data() + start, last - first + 1);
+            int lo_count = std::max(0, std::min(lo, last) - first + 1);
+            int hi_first = std::max(first, lo + 1);
+            if (lo_count > 0) {
+                p.head(lo_count) = (coords(lo) - coords.segment(first, lo_count) + Scalar(lo_dist)).square();
+            }
+            if (last >= hi_first) {
+                p.tail(last - hi_first + 1) = (coords.segment(hi_first, last - hi_first + 1) - coords(hi) + Scalar(hi_dist)).square();
+            }
+            p = (Scalar(-0.5 / sigma2) * p).exp() * weights.segment(first, last - first + 1);
 
-            // modify c
-            c = pow((2 * M_PI * sigma2), static_cast<double>(D)/2) * mu / (1 - mu) / N;
-            P = P.array().rowwise() / (P.colwise().sum().array() + c);
+            // normalize the column
+            double col_sum = p.template cast<double>().sum();
+            p /= Scalar(col_sum + c);
+            log_likelihood += log(col_sum + c);
         }
-        else {
-            P = P.array().rowwise() / (P.colwise().sum().array() + c);
+        starts[tile_end - tile_start] = values.size();
+
+        // fold the tile into the reductions
+        for (int i = tile_start; i < tile_end; i ++) {
+            int first = first_nodes[i - tile_start];
+            int count = starts[i - tile_start + 1] - starts[i - tile_start];
+            if (count == 0) {
+                continue;
+            }
+            Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>> p(values.data() + starts[i - tile_start], count);
+            P1.block(first, 0, count, 1) += p.template cast<double>();
+            Pt1(0, i) = p.template cast<double>().sum();
+            PX.middleRows(first, count) += p.template cast<double>() * X.col(i).transpose().template cast<double>();
         }
+    }
 
+    return log_likelihood - N * X.rows()/2.0 * log(2 * M_PI * sigma2);
+}
 
-        MatrixXd Pt1 = P.colwise().sum();
-        MatrixXd P1 = P.rowwise().sum();
-        double Np = P1.sum();
-        MatrixXd PX = P * X;
+std::vector<std::vector<int>> tracker::partition_points (const MatrixXd& X, const std::vector<int>& point_labels) {
+    int num_of_dlos = Y_.rows() / nodes_per_dlo_;
+    int N = X.rows();
 
-        // M step
-        MatrixXd A_matrix;
-        MatrixXd B_matrix;
-        if (include_lle) {
-            if (correspondence_priors.size() != 0) {
-                A_matrix = P1.asDiagonal()*G + lambda*sigma2 * MatrixXd::Identity(M, M) + sigma2*lle_weight * H*G + alpha*J*G;
-                B_matrix = PX - P1.asDiagonal()*Y_0 - sigma2*lle_weight * H*Y_0 + alpha*(Y_extended - Y_0);
-            }
-            else {
-                A_matrix = P1.asDiagonal()*G + lambda*sigma2 * MatrixXd::Identity(M, M) + sigma2*lle_weight * H*G;
-                B_matrix = PX - P1.asDiagonal()*Y_0 - sigma2*lle_weight * H*Y_0;
-            }
+    // nearest dlo of every point
+    std::vector<int> point_dlos(N, 0);
+    spatial_index Y_index(Y_, 0.02);
+    for (int n = 0; n < N; n ++) {
+        double dist;
+        point_dlos[n] = Y_index.nearest(X.row(n), dist) / nodes_per_dlo_;
+    }
+
+    if (point_labels.size() == N) {
+        // the color of a dlo is the most common label among its nearest points
+        std::vector<std::vector<int>> label_counts(num_of_dlos, std::vector<int>(256, 0));
+        for (int n = 0; n < N; n ++) {
+            label_counts[point_dlos[n]][point_labels[n] & 255] += 1;
         }
-        else {
-            if (correspondence_priors.size() != 0) {
-                A_matrix = P1.asDiagonal() * G + lambda * sigma2 * MatrixXd::Identity(M, M) + alpha*J*G;
-                B_matrix = PX - P1.asDiagonal() * Y_0 + alpha*(Y_extended - Y_0);
+        std::vector<int> dlo_labels(num_of_dlos, 0);
+        for (int d = 0; d < num_of_dlos; d ++) {
+            dlo_labels[d] = std::max_element(label_counts[d].begin(), label_counts[d].end()) - label_counts[d].begin();
+        }
+
+        // move points whose color disagrees with their nearest dlo to the nearest dlo of the same color
+        for (int n = 0; n < N; n ++) {
+            if (dlo_labels[point_dlos[n]] == point_labels[n]) {
+                continue;
             }
-            else {
-                A_matrix = P1.asDiagonal() * G + lambda * sigma2 * MatrixXd::Identity(M, M);
-                B_matrix = PX - P1.asDiagonal() * Y_0;
+            double shortest_dist = std::numeric_limits<double>::max();
+            for (int d = 0; d < num_of_dlos; d ++) {
+                if (dlo_labels[d] != point_labels[n]) {
+                    continue;
+                }
+                for (int m = d*nodes_per_dlo_; m < (d+1)*nodes_per_dlo_; m ++) {
+                    double dist = (Y_.row(m) - X.row(n)).squaredNorm();
+                    if (dist < shortest_dist) {
+                        shortest_dist = dist;
+                        point_dlos[n] = d;
+                    }
+                }
             }
         }
+    }
 
-        MatrixXd W = A_matrix.completeOrthogonalDecomposition().solve(B_matrix);
+    std::vector<std::vector<int>> partitions(num_of_dlos);
+    for (int n = 0; n < N; n ++) {
+        partitions[point_dlos[n]].push_back(n);
+    }
+    return partitions;
+}
 
-        MatrixXd T = Y_0 + G * W;
-        double trXtdPt1X = (X.transpose() * Pt1.asDiagonal() * X).trace();
-        double trPXtT = (PX.transpose() * T).trace();
-        double trTtdP1T = (T.transpose() * P1.asDiagonal() * T).trace();
+bool tracker::cpd_lle_partitioned (const MatrixXd& X_orig,
+                                   const std::vector<std::vector<int>>& partitions,
+                                   const std::vector<int>& node_dlos,
+                                   MatrixXd& Y,
+                                   double& sigma2,
+                                   double beta,
+                                   double lambda,
+                                   double lle_weight,
+                                   double mu,
+                                   int max_iter,
+                                   double tol,
+                                   bool include_lle,
+                                   std::vector<MatrixXd> correspondence_priors,
+                                   double alpha,
+                                   std::vector<int> visible_nodes,
+                                   double k_vis,
+                                   double visibility_threshold)
+{
+    bool converged = true;
+    double weighted_sigma2_sum = 0;
+    int num_of_registered_pts = 0;
+
+    // position of every node of Y inside its own dlo
+    std::vector<int> local_indices(Y.rows(), 0);
+    std::vector<int> dlo_sizes(partitions.size(), 0);
+    for (int i = 0; i < Y.rows(); i ++) {
+        local_indices[i] = dlo_sizes[node_dlos[i]];
+        dlo_sizes[node_dlos[i]] += 1;
+    }
 
-        sigma2 = (trXtdPt1X - 2*trPXtT + trTtdP1T) / (Np * D);
+    for (int d = 0; d < partitions.size(); d ++) {
+        // the geodesic reweighting needs at least three nodes
+        if (dlo_sizes[d] < 3 || partitions[d].empty()) {
+            continue;
+        }
 
-        if (pt2pt_dis(Y, Y_0 + G*W) / Y.rows() < tol) {
-            Y = Y_0 + G*W;
-            ROS_INFO_STREAM("Iteration until convergence: " + std::to_string(it+1));
-            break;
+        MatrixXd X_sub(partitions[d].size(), 3);
+        for (int n = 0; n < partitions[d].size(); n ++) {
+            X_sub.row(n) = X_orig.row(partitions[d][n]);
         }
-        else {
-            Y = Y_0 + G*W;
+
+        MatrixXd Y_sub(dlo_sizes[d], 3);
+        for (int i = 0; i < Y.rows(); i ++) {
+            if (node_dlos[i] == d) {
+                Y_sub.row(local_indices[i]) = Y.row(i);
+            }
         }
 
-        if (it == max_iter - 1) {
-            ROS_ERROR("optimization did not converge!");
-            converged = false;
-            break;
+        std::vector<MatrixXd> correspondence_priors_sub = {};
+        for (auto prior : correspondence_priors) {
+            int index = prior(0, 0);
+            if (node_dlos[index] == d) {
+                prior(0, 0) = local_indices[index];
+                correspondence_priors_sub.push_back(prior);
+            }
+        }
+
+        std::vector<int> visible_nodes_sub = {};
+        for (auto id : visible_nodes) {
+            if (node_dlos[id] == d) {
+                visible_nodes_sub.push_back(local_indices[id]);
+            }
+        }
+
+        // a single dlo tracker: the kernel and lle matrices are built over this dlo only
+        double sigma2_sub = sigma2;
+        // one tracker per dlo and node count. the pre-processing pass only sees the guide nodes,
+        // so an occluded dlo has a different size there than in the tracking pass
+        std::pair<int, int> key(d, dlo_sizes[d]);
+        int tracker_idx = std::find(dlo_tracker_keys_.begin(), dlo_tracker_keys_.end(), key) - dlo_tracker_keys_.begin();
+        if (tracker_idx == dlo_tracker_keys_.size()) {
+            dlo_tracker_keys_.push_back(key);
+            dlo_trackers_.push_back(tracker(dlo_sizes[d]));
         }
+        tracker& dlo_tracker = dlo_trackers_[tracker_idx];
+        dlo_tracker.set_m_step_solver(m_step_solver_);
+        dlo_tracker.set_e_step_truncation(e_step_truncation_);
+        dlo_tracker.set_single_precision(single_precision_);
+        dlo_tracker.set_kernel_cache_tolerance(kernel_cache_tolerance_);
+        dlo_tracker.set_use_em_acceleration(use_em_acceleration_);
+        if (dlo_tracker.num_of_resolution_levels_ != num_of_resolution_levels_ || dlo_tracker.resolution_leaf_size_ != resolution_leaf_size_) {
+            dlo_tracker.set_multi_resolution(num_of_resolution_levels_, resolution_leaf_size_);
+        }
+        converged &= dlo_tracker.cpd_lle(X_sub, Y_sub, sigma2_sub, beta, lambda, lle_weight, mu, max_iter, tol, include_lle,
+                                         correspondence_priors_sub, alpha, visible_nodes_sub, k_vis, visibility_threshold);
+
+        for (int i = 0; i < Y.rows(); i ++) {
+            if (node_dlos[i] == d) {
+                Y.row(i) = Y_sub.row(local_indices[i]);
+            }
+        }
+
+        weighted_sigma2_sum += sigma2_sub * X_sub.rows();
+        num_of_registered_pts += X_sub.rows();
     }
-    
+
+    // one shared sigma2, weighted by the number of points of each dlo
+    if (num_of_registered_pts > 0) {
+        sigma2 = weighted_sigma2_sum / num_of_registered_pts;
+    }
+
     return converged;
 }
 
@@ -635,42 +1148,43 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
 
         int last_found_index = 0;
         int seg_dist_it = 0;
-        MatrixXd cur_center = guide_nodes.row(0);
+        RowVector3d cur_center = guide_nodes.row(0);
 
         // basically pure pursuit
         while (last_found_index+1 <= consecutive_visible_nodes.size()-1 && seg_dist_it+1 <= geodesic_coord.size()-1) {
             double look_ahead_dist = fabs(geodesic_coord[seg_dist_it+1] - geodesic_coord[seg_dist_it]);
             bool found_intersection = false;
-            std::vector<double> intersection = {};
+            RowVector3d intersection;
 
             for (int i = last_found_index; i+1 <= consecutive_visible_nodes.size()-1; i ++) {
-                std::vector<MatrixXd> intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i+1), cur_center, look_ahead_dist);
+                RowVector3d intersections[2];
+                int num_of_intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i+1), cur_center, look_ahead_dist, intersections);
 
                 // if no intersection found
-                if (intersections.size() == 0) {
+                if (num_of_intersections == 0) {
                     continue;
                 }
-                else if (intersections.size() == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i+1)) > pt2pt_dis(cur_center, guide_nodes.row(i+1))) {
+                else if (num_of_intersections == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i+1)) > pt2pt_dis(cur_center, guide_nodes.row(i+1))) {
                     continue;
                 }
                 else {
                     found_intersection = true;
                     last_found_index = i;
 
-                    if (intersections.size() == 2) {
+                    if (num_of_intersections == 2) {
                         if (pt2pt_dis(intersections[0], guide_nodes.row(i+1)) <= pt2pt_dis(intersections[1], guide_nodes.row(i+1))) {
                             // the first solution is closer
-                            intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                            intersection = intersections[0];
                             cur_center = intersections[0];
                         }
                         else {
                             // the second one is closer
-                            intersection = {intersections[1](0, 0), intersections[1](0, 1), intersections[1](0, 2)};
+                            intersection = intersections[1];
                             cur_center = intersections[1];
                         }
                     }
                     else {
-                        intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                        intersection = intersections[0];
                         cur_center = intersections[0];
                     }
                     break;
@@ -710,7 +1224,7 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
 
         int last_found_index = guide_nodes.rows()-1;
         int seg_dist_it = geodesic_coord.size()-1;
-        MatrixXd cur_center = guide_nodes.row(guide_nodes.rows()-1);
+        RowVector3d cur_center = guide_nodes.row(guide_nodes.rows()-1);
 
         // basically pure pursuit
         while (last_found_index-1 >= (guide_nodes.rows() - consecutive_visible_nodes.size()) && seg_dist_it-1 >= 0) {
@@ -718,36 +1232,37 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
             double look_ahead_dist = fabs(geodesic_coord[seg_dist_it] - geodesic_coord[seg_dist_it-1]);
 
             bool found_intersection = false;
-            std::vector<double> intersection = {};
+            RowVector3d intersection;
 
             for (int i = last_found_index; i >= (guide_nodes.rows() - consecutive_visible_nodes.size() + 1); i --) {
-                std::vector<MatrixXd> intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i-1), cur_center, look_ahead_dist);
+                RowVector3d intersections[2];
+                int num_of_intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i-1), cur_center, look_ahead_dist, intersections);
 
                 // if no intersection found
-                if (intersections.size() == 0) {
+                if (num_of_intersections == 0) {
                     continue;
                 }
-                else if (intersections.size() == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i-1)) > pt2pt_dis(cur_center, guide_nodes.row(i-1))) {
+                else if (num_of_intersections == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i-1)) > pt2pt_dis(cur_center, guide_nodes.row(i-1))) {
                     continue;
                 }
                 else {
                     found_intersection = true;
                     last_found_index = i;
 
-                    if (intersections.size() == 2) {
+                    if (num_of_intersections == 2) {
                         if (pt2pt_dis(intersections[0], guide_nodes.row(i-1)) <= pt2pt_dis(intersections[1], guide_nodes.row(i-1))) {
                             // the first solution is closer
-                            intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                            intersection = intersections[0];
                             cur_center = intersections[0];
                         }
                         else {
                             // the second one is closer
-                            intersection = {intersections[1](0, 0), intersections[1](0, 1), intersections[1](0, 2)};
+                            intersection = intersections[1];
                             cur_center = intersections[1];
                         }
                     }
                     else {
-                        intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                        intersection = intersections[0];
                         cur_center = intersections[0];
                     }
                     break;
@@ -788,42 +1303,43 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
         // traverse from the alignment node to the tail node
         int last_found_index = alignment_node_idx;
         int seg_dist_it = visible_nodes[alignment_node_idx];
-        MatrixXd cur_center = guide_nodes.row(alignment_node_idx);
+        RowVector3d cur_center = guide_nodes.row(alignment_node_idx);
 
         // basically pure pursuit
         while (last_found_index+1 <= alignment_node_idx+consecutive_visible_nodes_2.size()-1 && seg_dist_it+1 <= geodesic_coord.size()-1) {
             double look_ahead_dist = fabs(geodesic_coord[seg_dist_it+1] - geodesic_coord[seg_dist_it]);
             bool found_intersection = false;
-            std::vector<double> intersection = {};
+            RowVector3d intersection;
 
             for (int i = last_found_index; i+1 <= alignment_node_idx+consecutive_visible_nodes_2.size()-1; i ++) {
-                std::vector<MatrixXd> intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i+1), cur_center, look_ahead_dist);
+                RowVector3d intersections[2];
+                int num_of_intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i+1), cur_center, look_ahead_dist, intersections);
 
                 // if no intersection found
-                if (intersections.size() == 0) {
+                if (num_of_intersections == 0) {
                     continue;
                 }
-                else if (intersections.size() == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i+1)) > pt2pt_dis(cur_center, guide_nodes.row(i+1))) {
+                else if (num_of_intersections == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i+1)) > pt2pt_dis(cur_center, guide_nodes.row(i+1))) {
                     continue;
                 }
                 else {
                     found_intersection = true;
                     last_found_index = i;
 
-                    if (intersections.size() == 2) {
+                    if (num_of_intersections == 2) {
                         if (pt2pt_dis(intersections[0], guide_nodes.row(i+1)) <= pt2pt_dis(intersections[1], guide_nodes.row(i+1))) {
                             // the first solution is closer
-                            intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                            intersection = intersections[0];
                             cur_center = intersections[0];
                         }
                         else {
                             // the second one is closer
-                            intersection = {intersections[1](0, 0), intersections[1](0, 1), intersections[1](0, 2)};
+                            intersection = intersections[1];
                             cur_center = intersections[1];
                         }
                     }
                     else {
-                        intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                        intersection = intersections[0];
                         cur_center = intersections[0];
                     }
                     break;
@@ -865,36 +1381,37 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
         while (last_found_index-1 >= alignment_node_idx-consecutive_visible_nodes_1.size() && seg_dist_it-1 >= 0) {
             double look_ahead_dist = fabs(geodesic_coord[seg_dist_it] - geodesic_coord[seg_dist_it-1]);
             bool found_intersection = false;
-            std::vector<double> intersection = {};
+            RowVector3d intersection;
 
             for (int i = last_found_index; i-1 >= 0; i --) {
-                std::vector<MatrixXd> intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i-1), cur_center, look_ahead_dist);
+                RowVector3d intersections[2];
+                int num_of_intersections = line_sphere_intersection(guide_nodes.row(i), guide_nodes.row(i-1), cur_center, look_ahead_dist, intersections);
 
                 // if no intersection found
-                if (intersections.size() == 0) {
+                if (num_of_intersections == 0) {
                     continue;
                 }
-                else if (intersections.size() == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i-1)) > pt2pt_dis(cur_center, guide_nodes.row(i-1))) {
+                else if (num_of_intersections == 1 && pt2pt_dis(intersections[0], guide_nodes.row(i-1)) > pt2pt_dis(cur_center, guide_nodes.row(i-1))) {
                     continue;
                 }
                 else {
                     found_intersection = true;
                     last_found_index = i;
 
-                    if (intersections.size() == 2) {
+                    if (num_of_intersections == 2) {
                         if (pt2pt_dis(intersections[0], guide_nodes.row(i-1)) <= pt2pt_dis(intersections[1], guide_nodes.row(i-1))) {
                             // the first solution is closer
-                            intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                            intersection = intersections[0];
                             cur_center = intersections[0];
                         }
                         else {
                             // the second one is closer
-                            intersection = {intersections[1](0, 0), intersections[1](0, 1), intersections[1](0, 2)};
+                            intersection = intersections[1];
                             cur_center = intersections[1];
                         }
                     }
                     else {
-                        intersection = {intersections[0](0, 0), intersections[0](0, 1), intersections[0](0, 2)};
+                        intersection = intersections[0];
                         cur_center = intersections[0];
                     }
                     break;
@@ -920,17 +1437,34 @@ std::vector<MatrixXd> tracker::traverse_euclidean (std::vector<double> geodesic_
     return node_pairs;
 }
 
+// fraction of the node velocities kept from one frame to the next. motion along a dlo is barely
+// observable, so without it a velocity along the dlo would never be corrected
+static const double NODE_VELOCITY_DECAY = 0.8;
+
 void tracker::tracking_step (MatrixXd X_orig, 
                               std::vector<int> visible_nodes, 
                               std::vector<int> visible_nodes_extended, 
                               MatrixXd proj_matrix, 
                               int img_rows, 
-                              int img_cols) {
+                              int img_cols,
+                              std::vector<int> point_labels) {
     
     // variable initialization
     correspondence_priors_ = {};
     int state = 0;
 
+    // motion prediction: both registrations below start from (and are regularized towards) the
+    // predicted nodes
+    MatrixXd Y_pred;
+    if (motion_prediction_gain_ > 0) {
+        if (node_velocities_.rows() != Y_.rows()) {
+            node_velocities_ = MatrixXd::Zero(Y_.rows(), 3);
+            has_node_velocities_ = false;
+        }
+        Y_ += node_velocities_;
+        Y_pred = Y_.replicate(1, 1);
+    }
+
     // copy visible nodes vec to guide nodes
     // not using topRows() because it caused weird bugs
     guide_nodes_ = MatrixXd::Zero(visible_nodes_extended.size(), 3);
@@ -949,14 +1483,34 @@ void tracker::tracking_step (MatrixXd X_orig,
     // determine DLO state: heading visible, tail visible, both visible, or both occluded
     // priors_vec should be the final output; priors_vec[i] = {index, x, y, z}
     double sigma2_pre_proc = sigma2_;
+    int num_of_dlos = Y_.rows() / nodes_per_dlo_;
+
+    // split the points between dlos once, both registrations below reuse it
+    std::vector<std::vector<int>> partitions = {};
+    std::vector<int> node_dlos = {};
+    std::vector<int> guide_node_dlos = {};
+    if (partition_by_dlo_ && num_of_dlos > 1) {
+        partitions = partition_points(X_orig, point_labels);
+        for (int i = 0; i < Y_.rows(); i ++) {
+            node_dlos.push_back(i / nodes_per_dlo_);
+        }
+        for (int i = 0; i < guide_nodes_.rows(); i ++) {
+            int node_idx = (visible_nodes_extended.size() != Y_.rows()) ? visible_nodes_extended[i] : i;
+            guide_node_dlos.push_back(node_idx / nodes_per_dlo_);
+        }
+    }
+
     // pre-processing registration
-    cpd_lle(X_orig, guide_nodes_, sigma2_pre_proc, beta_pre_proc_, lambda_pre_proc_, lle_weight_, mu_, max_iter_, tol_, true);
+    if (!partitions.empty()) {
+        cpd_lle_partitioned(X_orig, partitions, guide_node_dlos, guide_nodes_, sigma2_pre_proc, beta_pre_proc_, lambda_pre_proc_, lle_weight_, mu_, max_iter_, tol_, true);
+    }
+    else {
+        cpd_lle(X_orig, guide_nodes_, sigma2_pre_proc, beta_pre_proc_, lambda_pre_proc_, lle_weight_, mu_, max_iter_, tol_, true);
+    }
 
     // // TEMP TEST
     // Y_ = guide_nodes_.replicate(1, 1);
 
-    int num_of_dlos = Y_.rows() / nodes_per_dlo_;
-
     // std::cout << "== visible_nodes_extended ==" << std::endl;
     // print_1d_vector(visible_nodes_extended);
 
@@ -1099,5 +1653,21 @@ void tracker::tracking_step (MatrixXd X_orig,
     // print_1d_vector(correspondence_priors_);
 
     // include_lle == false because we have no space to discuss it in the paper
-    cpd_lle (X_orig, Y_, sigma2_, beta_, lambda_, lle_weight_, mu_, max_iter_, tol_, false, correspondence_priors_, alpha_, visible_nodes_extended, k_vis_, visibility_threshold_);
+    if (!partitions.empty()) {
+        cpd_lle_partitioned(X_orig, partitions, node_dlos, Y_, sigma2_, beta_, lambda_, lle_weight_, mu_, max_iter_, tol_, false, correspondence_priors_, alpha_, visible_nodes_extended, k_vis_, visibility_threshold_);
+    }
+    else {
+        cpd_lle (X_orig, Y_, sigma2_, beta_, lambda_, lle_weight_, mu_, max_iter_, tol_, false, correspondence_priors_, alpha_, visible_nodes_extended, k_vis_, visibility_threshold_);
+    }
+
+    // alpha-beta filter with alpha = 1: the registered nodes are kept as they are and only the
+    // velocities are corrected. on the first frame after (re)initialization the prediction error
+    // is the initialization offset, not motion
+    if (motion_prediction_gain_ > 0) {
+        if (has_node_velocities_) {
+            MatrixXd prediction_error = Y_ - Y_pred;
+            node_velocities_ = NODE_VELOCITY_DECAY * (node_velocities_ + motion_prediction_gain_ * prediction_error);
+        }
+        has_node_velocities_ = true;
+    }
 }
\ No newline at end of file
@@ -1,5 +1,11 @@
 #include "../include/tracker.h"
 #include "../include/utils.h"
+#include "../include/pc_extractor.h"
+#include "../include/voxel_downsampler.h"
+#include "../include/spatial_index.h"
+#include "../include/visibility_checker.h"
+
+#include <sstream>
 
 using cv::Mat;
 
@@ -11,6 +17,7 @@ ros::Publisher self_occluded_pc_pub;
 ros::Publisher result_pc_pub;
 ros::Subscriber init_nodes_sub;
 ros::Subscriber camera_info_sub;
+image_transport::Publisher mask_pub;
 
 using Eigen::MatrixXd;
 using Eigen::RowVectorXd;
@@ -25,6 +32,7 @@ bool received_proj_matrix = false;
 MatrixXd init_nodes;
 std::vector<double> converted_node_coord = {0.0};
 Mat occlusion_mask;
+Mat occlusion_mask_gray;
 bool updated_opencv_mask = false;
 MatrixXd proj_matrix(3, 4);
 
@@ -40,6 +48,19 @@ bool include_lle;
 bool use_geodesic;
 bool use_prev_sigma2;
 double downsample_leaf_size;
+double max_depth;
+int num_of_threads;
+bool use_roi;
+double roi_margin;
+bool partition_by_dlo;
+std::string m_step_solver;
+double e_step_truncation;
+bool use_single_precision;
+double kernel_cache_tolerance;
+bool use_em_acceleration;
+int num_of_resolution_levels;
+double motion_prediction_gain;
+bool use_depth_visibility;
 int nodes_per_dlo;
 double dlo_diameter;
 double check_distance;
@@ -57,15 +78,31 @@ std::string rgb_topic;
 std::string depth_topic;
 std::string hsv_threshold_upper_limit;
 std::string hsv_threshold_lower_limit;
+std::string multi_color_hsv_lower_limits;
+std::string multi_color_hsv_upper_limits;
+std::string multi_color_labels;
 std::string result_frame_id;
 std::vector<int> upper;
 std::vector<int> lower;
+std::vector<std::vector<int>> hsv_lower_limits;
+std::vector<std::vector<int>> hsv_upper_limits;
+// color label of each hsv range (both red ranges share one label)
+std::vector<int> hsv_labels;
 
 tracker multi_dlo_tracker;
+pc_extractor extractor;
+voxel_downsampler downsampler;
+visibility_checker vis_checker;
+
+// post-processing kernel matrix and the geodesic coordinates it was built from
+MatrixXd post_proc_G;
+std::vector<double> post_proc_node_coord = {};
 
 void update_opencv_mask (const sensor_msgs::ImageConstPtr& opencv_mask_msg) {
     occlusion_mask = cv_bridge::toCvShare(opencv_mask_msg, "bgr8")->image;
     if (!occlusion_mask.empty()) {
+        // only changes when a new mask arrives, so convert here instead of every frame
+        cv::cvtColor(occlusion_mask, occlusion_mask_gray, cv::COLOR_BGR2GRAY);
         updated_opencv_mask = true;
     }
 }
@@ -90,42 +127,61 @@ void update_camera_info (const sensor_msgs::CameraInfoConstPtr& cam_msg) {
     camera_info_sub.shutdown();
 }
 
+int last_num_of_pts = 0;
+
 double pre_proc_total = 0;
 double algo_total = 0;
 double pub_data_total = 0;
 int frames = 0;
 
-Mat color_thresholding (Mat cur_image_hsv) {
-    std::vector<int> lower_blue = {90, 90, 60};
-    std::vector<int> upper_blue = {130, 255, 255};
-
-    std::vector<int> lower_red_1 = {130, 60, 50};
-    std::vector<int> upper_red_1 = {255, 255, 255};
-
-    std::vector<int> lower_red_2 = {0, 60, 50};
-    std::vector<int> upper_red_2 = {10, 255, 255};
-
-    std::vector<int> lower_yellow = {15, 100, 80};
-    std::vector<int> upper_yellow = {40, 255, 255};
-
-    Mat mask_blue, mask_red_1, mask_red_2, mask_red, mask_yellow, mask;
-    // filter blue
-    cv::inRange(cur_image_hsv, cv::Scalar(lower_blue[0], lower_blue[1], lower_blue[2]), cv::Scalar(upper_blue[0], upper_blue[1], upper_blue[2]), mask_blue);
+// "a b c, d e f, ..." -> {{a, b, c}, {d, e, f}, ...}
+std::vector<std::vector<int>> parse_int_groups (const std::string& str) {
+    std::vector<std::vector<int>> groups = {};
+    std::stringstream ss(str);
+    std::string group;
+    while (std::getline(ss, group, ',')) {
+        std::stringstream group_ss(group);
+        std::vector<int> values = {};
+        int value;
+        while (group_ss >> value) {
+            values.push_back(value);
+        }
+        if (!values.empty()) {
+            groups.push_back(values);
+        }
+    }
+    return groups;
+}
 
-    // filter red
-    cv::inRange(cur_image_hsv, cv::Scalar(lower_red_1[0], lower_red_1[1], lower_red_1[2]), cv::Scalar(upper_red_1[0], upper_red_1[1], upper_red_1[2]), mask_red_1);
-    cv::inRange(cur_image_hsv, cv::Scalar(lower_red_2[0], lower_red_2[1], lower_red_2[2]), cv::Scalar(upper_red_2[0], upper_red_2[1], upper_red_2[2]), mask_red_2);
+// hsv ranges and color labels used when multi_color_dlo is set, one comma separated "h s v"
+// triple per range and one label per range. without them the blue, red and yellow table
+// below is used (red wraps around the hue axis and needs two ranges, both labeled 2)
+void set_multi_color_thresholds (const std::string& lower_limits, const std::string& upper_limits, const std::string& labels) {
+    hsv_lower_limits = {{90, 90, 60}, {130, 60, 50}, {0, 60, 50}, {15, 100, 80}};
+    hsv_upper_limits = {{130, 255, 255}, {255, 255, 255}, {10, 255, 255}, {40, 255, 255}};
+    hsv_labels = {1, 2, 2, 3};
+    if (lower_limits.empty() && upper_limits.empty() && labels.empty()) {
+        return;
+    }
 
-    // filter yellow
-    cv::inRange(cur_image_hsv, cv::Scalar(lower_yellow[0], lower_yellow[1], lower_yellow[2]), cv::Scalar(upper_yellow[0], upper_yellow[1], upper_yellow[2]), mask_yellow);
+    std::vector<std::vector<int>> lower_groups = parse_int_groups(lower_limits);
+    std::vector<std::vector<int>> upper_groups = parse_int_groups(upper_limits);
+    std::vector<std::vector<int>> label_groups = parse_int_groups(labels);
+    std::vector<int> label_values = label_groups.empty() ? std::vector<int>() : label_groups[0];
 
-    // combine red mask
-    cv::bitwise_or(mask_red_1, mask_red_2, mask_red);
-    // combine overall mask
-    cv::bitwise_or(mask_red, mask_blue, mask);
-    cv::bitwise_or(mask_yellow, mask, mask);
+    bool valid = !lower_groups.empty() && lower_groups.size() == upper_groups.size() && label_groups.size() == 1
+                 && label_values.size() == lower_groups.size();
+    for (int i = 0; valid && i < lower_groups.size(); i ++) {
+        valid = lower_groups[i].size() == 3 && upper_groups[i].size() == 3 && label_values[i] > 0 && label_values[i] < 256;
+    }
+    if (!valid) {
+        ROS_ERROR("multi_color_hsv_lower_limits, multi_color_hsv_upper_limits and multi_color_labels need one \"h s v\" triple and one label (1-255) per range; using the default blue, red and yellow ranges");
+        return;
+    }
 
-    return mask;
+    hsv_lower_limits = lower_groups;
+    hsv_upper_limits = upper_groups;
+    hsv_labels = label_values;
 }
 
 sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, const sensor_msgs::ImageConstPtr& depth_msg) {
@@ -152,6 +208,14 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
             //     double lambda_pre_proc,
             //     double lle_weight);
             multi_dlo_tracker = tracker(init_nodes.rows(), nodes_per_dlo, visibility_threshold, beta, lambda, alpha, k_vis, mu, max_iter, tol, beta_pre_proc, lambda_pre_proc, lle_weight);
+            multi_dlo_tracker.set_partition_by_dlo(partition_by_dlo);
+            multi_dlo_tracker.set_m_step_solver(m_step_solver);
+            multi_dlo_tracker.set_e_step_truncation(e_step_truncation);
+            multi_dlo_tracker.set_single_precision(use_single_precision);
+            multi_dlo_tracker.set_kernel_cache_tolerance(kernel_cache_tolerance);
+            multi_dlo_tracker.set_use_em_acceleration(use_em_acceleration);
+            multi_dlo_tracker.set_multi_resolution(num_of_resolution_levels, downsample_leaf_size);
+            multi_dlo_tracker.set_motion_prediction_gain(motion_prediction_gain);
 
             sigma2 = 0.00001;
 
@@ -165,6 +229,12 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
                 converted_node_coord.push_back(cur_sum);
             }
 
+            // ray lookup tables only depend on the camera intrinsics and image size
+            extractor = pc_extractor(proj_matrix, cur_image_orig.rows, cur_image_orig.cols, 0.0, max_depth, num_of_threads);
+            extractor.set_hsv_thresholds(hsv_lower_limits, hsv_upper_limits, hsv_labels);
+            downsampler = voxel_downsampler(downsample_leaf_size);
+            vis_checker = visibility_checker(proj_matrix, nodes_per_dlo, dlo_pixel_width);
+
             multi_dlo_tracker.initialize_nodes(init_nodes);
             multi_dlo_tracker.initialize_geodesic_coord(converted_node_coord);
             Y = init_nodes.replicate(1, 1);
@@ -178,97 +248,67 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
         double time_diff;
         std::chrono::high_resolution_clock::time_point cur_time;
 
-        Mat mask, mask_rgb, mask_without_occlusion_block;
-        Mat cur_image_hsv;
-
-        // convert color
-        cv::cvtColor(cur_image_orig, cur_image_hsv, cv::COLOR_BGR2HSV);
-
-        if (!multi_color_dlo) {
-            // color_thresholding
-            cv::inRange(cur_image_hsv, cv::Scalar(lower[0], lower[1], lower[2]), cv::Scalar(upper[0], upper[1], upper[2]), mask_without_occlusion_block);
-        }
-        else {
-            mask_without_occlusion_block = color_thresholding(cur_image_hsv);
-        }
-
         // update cur image for visualization
         Mat cur_image;
-        Mat occlusion_mask_gray;
         if (updated_opencv_mask) {
-            cv::cvtColor(occlusion_mask, occlusion_mask_gray, cv::COLOR_BGR2GRAY);
-            cv::bitwise_and(mask_without_occlusion_block, occlusion_mask_gray, mask);
             cv::bitwise_and(cur_image_orig, occlusion_mask, cur_image);
         }
         else {
-            mask_without_occlusion_block.copyTo(mask);
-            cur_image_orig.copyTo(cur_image);
+            cur_image = cur_image_orig;
         }
 
-        cv::cvtColor(mask, mask_rgb, cv::COLOR_GRAY2BGR);
-
         bool simulated_occlusion = false;
         int occlusion_corner_i = -1;
         int occlusion_corner_j = -1;
-        int occlusion_corner_i_2 = -1;
-        int occlusion_corner_j_2 = -1;
 
-        // filter point cloud
-        pcl::PointCloud<pcl::PointXYZRGB> cur_pc;
-        pcl::PointCloud<pcl::PointXYZRGB> cur_pc_downsampled;
-
-        // filter point cloud from mask
-        for (int i = 0; i < mask.rows; i ++) {
-            for (int j = 0; j < mask.cols; j ++) {
-                // for text label (visualization)
-                if (updated_opencv_mask && !simulated_occlusion && occlusion_mask_gray.at<uchar>(i, j) == 0) {
-                    occlusion_corner_i = i;
-                    occlusion_corner_j = j;
-                    simulated_occlusion = true;
+        // for text label (visualization): first pixel covered by the occlusion mask
+        if (updated_opencv_mask) {
+            for (int i = 0; i < occlusion_mask_gray.rows && !simulated_occlusion; i ++) {
+                const uchar* occlusion_row = occlusion_mask_gray.ptr<uchar>(i);
+                for (int j = 0; j < occlusion_mask_gray.cols; j ++) {
+                    if (occlusion_row[j] == 0) {
+                        occlusion_corner_i = i;
+                        occlusion_corner_j = j;
+                        simulated_occlusion = true;
+                        break;
+                    }
                 }
+            }
+        }
 
-                // update the other corner of occlusion mask (visualization)
-                if (updated_opencv_mask && occlusion_mask_gray.at<uchar>(i, j) == 0) {
-                    occlusion_corner_i_2 = i;
-                    occlusion_corner_j_2 = j;
-                }
+        // color labeling, occlusion masking and point cloud filtering in one pass;
+        // the mask image itself is only needed if someone is listening
+        Mat mask;
+        bool publish_mask = mask_pub.getNumSubscribers() > 0;
 
-                if (mask.at<uchar>(i, j) != 0) {
-                    // point cloud from image pixel coordinates and depth value
-                    pcl::PointXYZRGB point;
-                    double pixel_x = static_cast<double>(j);
-                    double pixel_y = static_cast<double>(i);
-                    double cx = proj_matrix(0, 2);
-                    double cy = proj_matrix(1, 2);
-                    double fx = proj_matrix(0, 0);
-                    double fy = proj_matrix(1, 1);
-                    double pc_z = cur_depth.at<uint16_t>(i, j) / 1000.0;
-
-                    point.x = (pixel_x - cx) * pc_z / fx;
-                    point.y = (pixel_y - cy) * pc_z / fy;
-                    point.z = pc_z;
-
-                    // currently something so color doesn't show up in rviz
-                    // point.r = cur_image_orig.at<cv::Vec3b>(i, j)[0];
-                    // point.g = cur_image_orig.at<cv::Vec3b>(i, j)[1];
-                    // point.b = cur_image_orig.at<cv::Vec3b>(i, j)[2];
-                    point.r = 255;
-                    point.g = 255;
-                    point.b = 255;
-
-                    cur_pc.push_back(point);
-                }
-            }
+        // only look around where the dlos were in the last frame
+        if (use_roi && last_num_of_pts > 0) {
+            extractor.set_roi(Y, nodes_per_dlo, roi_margin);
         }
+        else if (extractor.has_roi()) {
+            extractor.clear_roi();
+        }
+        int num_of_pts = extractor.extract(cur_image_orig, cur_depth, updated_opencv_mask ? occlusion_mask_gray : Mat(), mask, publish_mask);
 
-        // Perform downsampling
-        pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr cloudPtr(cur_pc.makeShared());
-        pcl::VoxelGrid<pcl::PointXYZRGB> sor;
-        sor.setInputCloud (cloudPtr);
-        sor.setLeafSize (downsample_leaf_size, downsample_leaf_size, downsample_leaf_size);
-        sor.filter(cur_pc_downsampled);
+        // a sudden drop in points usually means a dlo moved out of the roi
+        if (extractor.has_roi() && num_of_pts < last_num_of_pts / 2) {
+            ROS_WARN_STREAM("Lost points in predicted ROI, falling back to full frame");
+            extractor.clear_roi();
+            num_of_pts = extractor.extract(cur_image_orig, cur_depth, updated_opencv_mask ? occlusion_mask_gray : Mat(), mask, publish_mask);
+        }
+        last_num_of_pts = num_of_pts;
+
+        if (publish_mask) {
+            // the extractor writes color labels, publish them as a binary mask
+            Mat mask_binary = mask > 0;
+            Mat mask_rgb;
+            cv::cvtColor(mask_binary, mask_rgb, cv::COLOR_GRAY2BGR);
+            mask_pub.publish(cv_bridge::CvImage(std_msgs::Header(), "bgr8", mask_rgb).toImageMsg());
+        }
 
-        MatrixXd X = cur_pc_downsampled.getMatrixXfMap().topRows(3).transpose().cast<double>();
+        // downsample straight from the extracted buffer into the tracker's layout
+        std::vector<int> X_labels;
+        MatrixXd X = downsampler.downsample(extractor.get_points(), num_of_pts, extractor.get_labels(), X_labels);
         ROS_INFO_STREAM("Number of points in downsampled point cloud: " + std::to_string(X.rows()));
 
         MatrixXd guide_nodes;
@@ -282,104 +322,44 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
 
         int num_of_dlos = Y.rows() / nodes_per_dlo;
 
-        // calculate node visibility
-        // for each node in Y, determine its shortest distance to X
-        // for each point in X, determine its shortest distance to Y
-        std::map<int, double> shortest_node_pt_dists;
-        std::vector<double> shortest_pt_node_dists(X.rows(), 100000.0);
-        for (int m = 0; m < Y.rows(); m ++) {
-            int closest_pt_idx = 0;
-            double shortest_dist = 100000;
-            // loop through all points in X
-            for (int n = 0; n < X.rows(); n ++) {
-                double dist = (Y.row(m) - X.row(n)).norm();
-                // update shortest dist for Y
-                if (dist < shortest_dist) {
-                    closest_pt_idx = n;
-                    shortest_dist = dist;
-                }
-
-                // update shortest dist for X
-                if (dist < shortest_pt_node_dists[n]) {
-                    shortest_pt_node_dists[n] = dist;
-                }
-            }
-            shortest_node_pt_dists.insert(std::pair<int, double>(m, shortest_dist));
-        }
-
-        // for current nodes and edges in Y, sort them based on how far away they are from the camera
-        std::vector<double> averaged_node_camera_dists = {};
-        std::vector<int> indices_vec = {};
-        for (int i = 0; i < Y.rows()-1; i ++) {
-            averaged_node_camera_dists.push_back(((Y.row(i) + Y.row(i+1)) / 2).norm());
-            indices_vec.push_back(i);
-        }
-        // sort
-        std::sort(indices_vec.begin(), indices_vec.end(),
-            [&](const int& a, const int& b) {
-                return (averaged_node_camera_dists[a] < averaged_node_camera_dists[b]);
-            }
-        );
-        Mat projected_edges = Mat::zeros(mask.rows, mask.cols, CV_8U);
-
-        // project Y^{t-1} onto projected_edges
-        MatrixXd Y_h = Y.replicate(1, 1);
-        Y_h.conservativeResize(Y_h.rows(), Y_h.cols()+1);
-        Y_h.col(Y_h.cols()-1) = MatrixXd::Ones(Y_h.rows(), 1);
-        MatrixXd image_coords_mask = (proj_matrix * Y_h.transpose()).transpose();
-
         std::vector<int> visible_nodes = {};
         std::vector<int> self_occluded_nodes = {};
-        std::vector<int> not_self_occluded_nodes = {};
-        std::vector<int> self_occluding_nodes = {};
-
-        // draw edges closest to the camera first
-        for (int idx : indices_vec) {
-            if ((idx + 1) % nodes_per_dlo == 0) {
-                continue;
-            }
-
-            int col_1 = static_cast<int>(image_coords_mask(idx, 0)/image_coords_mask(idx, 2));
-            int row_1 = static_cast<int>(image_coords_mask(idx, 1)/image_coords_mask(idx, 2));
-
-            int col_2 = static_cast<int>(image_coords_mask(idx+1, 0)/image_coords_mask(idx+1, 2));
-            int row_2 = static_cast<int>(image_coords_mask(idx+1, 1)/image_coords_mask(idx+1, 2));
-
-            // only add to visible nodes if did not overlap with existing edges
-            if (projected_edges.at<uchar>(row_1, col_1) == 0) {
-                if (shortest_node_pt_dists[idx] <= visibility_threshold) {
-                    if (std::find(visible_nodes.begin(), visible_nodes.end(), idx) == visible_nodes.end()) {
-                        visible_nodes.push_back(idx);
-                    }
+        if (use_depth_visibility) {
+            // O(M): look up the measured depth at every projected node. nodes with something in
+            // front of them (another dlo or an external occluder) are reported as occluded
+            std::vector<int> node_states = vis_checker.classify_by_depth(Y, cur_depth, visibility_threshold);
+            for (int m = 0; m < Y.rows(); m ++) {
+                if (node_states[m] == visibility_checker::VISIBLE) {
+                    visible_nodes.push_back(m);
                 }
-                if (std::find(not_self_occluded_nodes.begin(), not_self_occluded_nodes.end(), idx) == not_self_occluded_nodes.end()) {
-                    not_self_occluded_nodes.push_back(idx);
+                else if (node_states[m] == visibility_checker::OCCLUDED) {
+                    self_occluded_nodes.push_back(m);
                 }
             }
+        }
+        else {
+            // calculate node visibility
+            // for each node in Y, determine its shortest distance to X. only distances
+            // within visibility_threshold matter, so the query stops there
+            spatial_index X_index(X, visibility_threshold);
+            std::vector<double> shortest_node_pt_dists(Y.rows(), 100000);
+            for (int m = 0; m < Y.rows(); m ++) {
+                X_index.nearest(Y.row(m), shortest_node_pt_dists[m], visibility_threshold);
+            }
 
-            // do not consider adjacent nodes directly on top of each other
-            if (projected_edges.at<uchar>(row_2, col_2) == 0) {
-                if (shortest_node_pt_dists[idx+1] <= visibility_threshold) {
-                    if (std::find(visible_nodes.begin(), visible_nodes.end(), idx+1) == visible_nodes.end()) {
-                        visible_nodes.push_back(idx+1);
-                    }
+            // a node is visible if no closer edge of Y^{t-1} covers it in the image and it is close to X
+            std::vector<bool> self_unoccluded = vis_checker.get_self_unoccluded_nodes(Y);
+            for (int m = 0; m < Y.rows(); m ++) {
+                if (self_unoccluded[m] && shortest_node_pt_dists[m] <= visibility_threshold) {
+                    visible_nodes.push_back(m);
                 }
-                if (std::find(not_self_occluded_nodes.begin(), not_self_occluded_nodes.end(), idx+1) == not_self_occluded_nodes.end()) {
-                    not_self_occluded_nodes.push_back(idx+1);
+                // nodes behind the camera are not visible, but not occluded by the dlo either
+                if (!self_unoccluded[m] && vis_checker.has_projection(m)) {
+                    self_occluded_nodes.push_back(m);
                 }
             }
-
-            // add edges for checking overlap with upcoming nodes
-            double x1 = col_1;
-            double y1 = row_1;
-            double x2 = col_2;
-            double y2 = row_2;
-            cv::line(projected_edges, cv::Point(x1, y1), cv::Point(x2, y2), cv::Scalar(255, 255, 255), dlo_pixel_width);
         }
 
-        // sort visible nodes to preserve the original connectivity
-        std::sort(visible_nodes.begin(), visible_nodes.end());
-
         std::cout << "===== visible nodes =====" << std::endl;
         print_1d_vector(visible_nodes);
 
@@ -405,7 +385,7 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
         MatrixXd Y_0 = Y.replicate(1, 1);
         
         // step tracker
-        multi_dlo_tracker.tracking_step(X, visible_nodes, visible_nodes_extended, proj_matrix, mask.rows, mask.cols);
+        multi_dlo_tracker.tracking_step(X, visible_nodes, visible_nodes_extended, proj_matrix, cur_image_orig.rows, cur_image_orig.cols, X_labels);
         Y = multi_dlo_tracker.get_tracking_result();
         guide_nodes = multi_dlo_tracker.get_guide_nodes();
         priors = multi_dlo_tracker.get_correspondence_pairs();
@@ -439,38 +419,44 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
         int kernel = 1;
         double beta_post_proc = 0.1;
 
-        MatrixXd converted_node_dis = MatrixXd::Zero(M, M); // this is a M*M matrix in place of diff_sqrt
-        MatrixXd converted_node_dis_sq = MatrixXd::Zero(M, M);
         std::vector<double> converted_node_coord = {0.0};   // this is not squared
-
-        MatrixXd G = MatrixXd::Zero(M, M);
-
         double cur_sum = 0;
         for (int i = 0; i < M-1; i ++) {
             cur_sum += pt2pt_dis(Y_0.row(i+1), Y_0.row(i));
             converted_node_coord.push_back(cur_sum);
         }
 
-        for (int i = 0; i < converted_node_coord.size(); i ++) {
-            for (int j = 0; j < converted_node_coord.size(); j ++) {
-                converted_node_dis_sq(i, j) = pow(converted_node_coord[i] - converted_node_coord[j], 2);
-                converted_node_dis(i, j) = abs(converted_node_coord[i] - converted_node_coord[j]);
-            }
+        // G only depends on the geodesic coordinates, reuse it while they have barely changed
+        bool G_valid = (kernel_cache_tolerance > 0 && post_proc_node_coord.size() == M);
+        for (int i = 0; i < M && G_valid; i ++) {
+            G_valid = (fabs(converted_node_coord[i] - post_proc_node_coord[i]) <= kernel_cache_tolerance);
         }
 
-        G = 1/(2*beta_post_proc * 2*beta_post_proc) * (-sqrt(2)*converted_node_dis/beta_post_proc).array().exp() * (sqrt(2)*converted_node_dis.array() + beta_post_proc);
+        if (!G_valid) {
+            MatrixXd converted_node_dis = MatrixXd::Zero(M, M); // this is a M*M matrix in place of diff_sqrt
+            for (int i = 0; i < M; i ++) {
+                for (int j = 0; j < M; j ++) {
+                    converted_node_dis(i, j) = abs(converted_node_coord[i] - converted_node_coord[j]);
+                }
+            }
+
+            MatrixXd G = 1/(2*beta_post_proc * 2*beta_post_proc) * (-sqrt(2)*converted_node_dis/beta_post_proc).array().exp() * (sqrt(2)*converted_node_dis.array() + beta_post_proc);
 
-        if (use_geodesic && num_of_dlos > 1) {
-            MatrixXd G_new = MatrixXd::Zero(M, M);
-            for (int i = 0; i < num_of_dlos; i ++) {
-                int start = i * nodes_per_dlo;
-                G_new.block(start, start, nodes_per_dlo, nodes_per_dlo) = G.block(start, start, nodes_per_dlo, nodes_per_dlo);
+            if (use_geodesic && num_of_dlos > 1) {
+                MatrixXd G_new = MatrixXd::Zero(M, M);
+                for (int i = 0; i < num_of_dlos; i ++) {
+                    int start = i * nodes_per_dlo;
+                    G_new.block(start, start, nodes_per_dlo, nodes_per_dlo) = G.block(start, start, nodes_per_dlo, nodes_per_dlo);
+                }
+                G = G_new.replicate(1, 1);
             }
-            G = G_new.replicate(1, 1);
+
+            post_proc_G = G;
+            post_proc_node_coord = converted_node_coord;
         }
 
         //post_processing
-        MatrixXd Y_processed = post_processing(Y_0.transpose(), Y.transpose(), new_edges, init_nodes.transpose(), G);
+        MatrixXd Y_processed = post_processing(Y_0.transpose(), Y.transpose(), new_edges, init_nodes.transpose(), post_proc_G);
         Y = Y_processed.replicate(1, 1);
 
         // log time
@@ -480,8 +466,8 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
         cur_time = std::chrono::high_resolution_clock::now();
 
         // projection and pub image
-        averaged_node_camera_dists = {};
-        indices_vec = {};
+        std::vector<double> averaged_node_camera_dists = {};
+        std::vector<int> indices_vec = {};
         for (int i = 0; i < Y.rows()-1; i ++) {
             averaged_node_camera_dists.push_back(((Y.row(i) + Y.row(i+1)) / 2).norm());
             indices_vec.push_back(i);
@@ -571,6 +557,20 @@ sensor_msgs::ImagePtr Callback(const sensor_msgs::ImageConstPtr& image_msg, cons
         }
 
         // publish filtered point cloud
+        pcl::PointCloud<pcl::PointXYZRGB> cur_pc_downsampled;
+        cur_pc_downsampled.resize(X.rows());
+        for (int i = 0; i < X.rows(); i ++) {
+            pcl::PointXYZRGB& point = cur_pc_downsampled.points[i];
+            point.x = X(i, 0);
+            point.y = X(i, 1);
+            point.z = X(i, 2);
+
+            // currently something so color doesn't show up in rviz
+            point.r = 255;
+            point.g = 255;
+            point.b = 255;
+        }
+
         pcl::PCLPointCloud2 cur_pc_pointcloud2;
         pcl::PCLPointCloud2 result_pc_poincloud2;
         pcl::PCLPointCloud2 self_occluded_pc_poincloud2;
@@ -646,6 +646,19 @@ int main(int argc, char **argv) {
     nh.getParam("/multidlo/check_distance", check_distance);
     nh.getParam("/multidlo/clamp", clamp);
     nh.getParam("/multidlo/downsample_leaf_size", downsample_leaf_size);
+    nh.getParam("/multidlo/max_depth", max_depth);
+    nh.getParam("/multidlo/num_of_threads", num_of_threads);
+    nh.getParam("/multidlo/use_roi", use_roi);
+    nh.getParam("/multidlo/roi_margin", roi_margin);
+    nh.getParam("/multidlo/partition_by_dlo", partition_by_dlo);
+    nh.getParam("/multidlo/m_step_solver", m_step_solver);
+    nh.getParam("/multidlo/e_step_truncation", e_step_truncation);
+    nh.getParam("/multidlo/use_single_precision", use_single_precision);
+    nh.getParam("/multidlo/kernel_cache_tolerance", kernel_cache_tolerance);
+    nh.getParam("/multidlo/use_em_acceleration", use_em_acceleration);
+    nh.getParam("/multidlo/num_of_resolution_levels", num_of_resolution_levels);
+    nh.getParam("/multidlo/motion_prediction_gain", motion_prediction_gain);
+    nh.getParam("/multidlo/use_depth_visibility", use_depth_visibility);
 
     nh.getParam("/multidlo/camera_info_topic", camera_info_topic);
     nh.getParam("/multidlo/rgb_topic", rgb_topic);
@@ -654,6 +667,9 @@ int main(int argc, char **argv) {
 
     nh.getParam("/multidlo/hsv_threshold_upper_limit", hsv_threshold_upper_limit);
     nh.getParam("/multidlo/hsv_threshold_lower_limit", hsv_threshold_lower_limit);
+    nh.getParam("/multidlo/multi_color_hsv_lower_limits", multi_color_hsv_lower_limits);
+    nh.getParam("/multidlo/multi_color_hsv_upper_limits", multi_color_hsv_upper_limits);
+    nh.getParam("/multidlo/multi_color_labels", multi_color_labels);
 
     nh.getParam("/multidlo/visibility_threshold", visibility_threshold);
     nh.getParam("/multidlo/dlo_pixel_width", dlo_pixel_width);
@@ -690,10 +706,19 @@ int main(int argc, char **argv) {
         }
         
         if (i == hsv_threshold_lower_limit.length()-1) {
-            upper.push_back(std::stoi(rgb_val));
+            lower.push_back(std::stoi(rgb_val));
         }
     }
 
+    if (multi_color_dlo) {
+        set_multi_color_thresholds(multi_color_hsv_lower_limits, multi_color_hsv_upper_limits, multi_color_labels);
+    }
+    else {
+        hsv_lower_limits = {lower};
+        hsv_upper_limits = {upper};
+        hsv_labels = {1};
+    }
+
     int pub_queue_size = 30;
 
     image_transport::ImageTransport it(nh);
@@ -701,7 +726,7 @@ int main(int argc, char **argv) {
     init_nodes_sub = nh.subscribe("/init_nodes", 1, update_init_nodes);
     camera_info_sub = nh.subscribe(camera_info_topic, 1, update_camera_info);
 
-    image_transport::Publisher mask_pub = it.advertise("/mask", pub_queue_size);
+    mask_pub = it.advertise("/mask", pub_queue_size);
     image_transport::Publisher tracking_img_pub = it.advertise("/results_img", pub_queue_size);
     pc_pub = nh.advertise<sensor_msgs::PointCloud2>("/filtered_pointcloud", pub_queue_size);
     results_pub = nh.advertise<visualization_msgs::MarkerArray>("/results_marker", pub_queue_size);
@@ -5,6 +5,8 @@ using Eigen::MatrixXd;
 using Eigen::RowVectorXd;
 using Eigen::Matrix2Xi;
 using Eigen::Vector3d;
+using Eigen::RowVector3d;
+using Eigen::Ref;
 using cv::Mat;
 
 void signal_callback_handler(int signum) {
@@ -12,12 +14,13 @@ void signal_callback_handler(int signum) {
    exit(signum);
 }
 
-double pt2pt_dis_sq (MatrixXd pt1, MatrixXd pt2) {
-    return (pt1 - pt2).rowwise().squaredNorm().sum();
-}
-
-double pt2pt_dis (MatrixXd pt1, MatrixXd pt2) {
-    return (pt1 - pt2).rowwise().norm().sum();
+MatrixXd pairwise_sq_dists (const MatrixXd& Y, const MatrixXd& X) {
+    // |y|^2 + |x|^2 - 2 y.x: one matrix product instead of M * N row differences.
+    // cancellation can leave tiny negative values, hence the clamp
+    MatrixXd dists = -2.0 * Y * X.transpose();
+    dists.colwise() += Y.rowwise().squaredNorm();
+    dists.rowwise() += X.rowwise().squaredNorm().transpose();
+    return dists.cwiseMax(0.0);
 }
 
 void reg (MatrixXd pts, MatrixXd& Y, double& sigma2, int M, double mu, int max_iter) {
@@ -34,26 +37,16 @@ void reg (MatrixXd pts, MatrixXd& Y, double& sigma2, int M, double mu, int max_i
     int D = 3;
 
     // diff_xy should be a (M * N) matrix
-    MatrixXd diff_xy = MatrixXd::Zero(M, N);
-    for (int i = 0; i < M; i ++) {
-        for (int j = 0; j < N; j ++) {
-            diff_xy(i, j) = (Y.row(i) - X.row(j)).squaredNorm();
-        }
-    }
+    MatrixXd diff_xy = pairwise_sq_dists(Y, X);
 
     // initialize sigma2
     sigma2 = diff_xy.sum() / static_cast<double>(D * M * N);
 
     for (int it = 0; it < max_iter; it ++) {
         // update diff_xy
-        for (int i = 0; i < M; i ++) {
-            for (int j = 0; j < N; j ++) {
-                diff_xy(i, j) = (Y.row(i) - X.row(j)).squaredNorm();
-            }
-        }
+        diff_xy = pairwise_sq_dists(Y, X);
 
         MatrixXd P = (-0.5 * diff_xy / sigma2).array().exp();
-        MatrixXd P_stored = P.replicate(1, 1);
         double c = pow((2 * M_PI * sigma2), static_cast<double>(D)/2) * mu / (1 - mu) * static_cast<double>(M)/N;
         P = P.array().rowwise() / (P.colwise().sum().array() + c);
 
@@ -69,15 +62,8 @@ void reg (MatrixXd pts, MatrixXd& Y, double& sigma2, int M, double mu, int max_i
 
         Y = PX.cwiseQuotient(P1_expanded);
 
-        double numerator = 0;
-        double denominator = 0;
-
-        for (int m = 0; m < M; m ++) {
-            for (int n = 0; n < N; n ++) {
-                numerator += P(m, n)*diff_xy(m, n);
-                denominator += P(m, n)*D;
-            }
-        }
+        double numerator = P.cwiseProduct(diff_xy).sum();
+        double denominator = P.sum() * D;
 
         sigma2 = numerator / denominator;
     }
@@ -102,12 +88,9 @@ MatrixXd sort_pts (MatrixXd Y_0) {
     selected_node[0] = true;
     int last_visited_b = 0;
 
-    MatrixXd G = MatrixXd::Zero(N, N);
-    for (int i = 0; i < N; i ++) {
-        for (int j = 0; j < N; j ++) {
-            G(i, j) = (Y_0.row(i) - Y_0.row(j)).squaredNorm();
-        }
-    }
+    // the diagonal is exactly 0 in the expanded form only up to rounding
+    MatrixXd G = pairwise_sq_dists(Y_0, Y_0);
+    G.diagonal().setZero();
 
     int reverse = 0;
     int counter = 0;
@@ -171,84 +154,58 @@ MatrixXd sort_pts (MatrixXd Y_0) {
     return Y_0_sorted;
 }
 
-bool isBetween (MatrixXd x, MatrixXd a, MatrixXd b) {
-    bool in_bound = true;
+int line_sphere_intersection (const Ref<const RowVector3d>& point_A, const Ref<const RowVector3d>& point_B,
+                              const Ref<const RowVector3d>& sphere_center, double radius, RowVector3d intersections[2]) {
+    RowVector3d dir = point_B - point_A;
+    double a = dir.squaredNorm();
+    double b = 2 * dir.dot(point_A - sphere_center);
+    double c = (point_A - sphere_center).squaredNorm() - radius*radius;
 
-    for (int i = 0; i < 3; i ++) {
-        if (!(a(0, i)-0.0001 <= x(0, i) && x(0, i) <= b(0, i)+0.0001) && 
-            !(b(0, i)-0.0001 <= x(0, i) && x(0, i) <= a(0, i)+0.0001)) {
-            in_bound = false;
-        }
-    }
-    
-    return in_bound;
-}
-
-std::vector<MatrixXd> line_sphere_intersection (MatrixXd point_A, MatrixXd point_B, MatrixXd sphere_center, double radius) {
-    std::vector<MatrixXd> intersections = {};
-    
-    double a = pt2pt_dis_sq(point_A, point_B);
-    double b = 2 * ((point_B(0, 0) - point_A(0, 0))*(point_A(0, 0) - sphere_center(0, 0)) + 
-                    (point_B(0, 1) - point_A(0, 1))*(point_A(0, 1) - sphere_center(0, 1)) + 
-                    (point_B(0, 2) - point_A(0, 2))*(point_A(0, 2) - sphere_center(0, 2)));
-    double c = pt2pt_dis_sq(point_A, sphere_center) - pow(radius, 2);
-    
-    double delta = pow(b, 2) - 4*a*c;
-
-    double d1 = (-b + sqrt(delta)) / (2*a);
-    double d2 = (-b - sqrt(delta)) / (2*a);
+    double delta = b*b - 4*a*c;
 
     if (delta < 0) {
         // no solution
-        return {};
+        return 0;
     }
-    else if (delta > 0) {
+
+    int num_of_intersections = 0;
+    if (delta > 0) {
         // two solutions
-        // the first one
-        double x1 = point_A(0, 0) + d1*(point_B(0, 0) - point_A(0, 0));
-        double y1 = point_A(0, 1) + d1*(point_B(0, 1) - point_A(0, 1));
-        double z1 = point_A(0, 2) + d1*(point_B(0, 2) - point_A(0, 2));
-        MatrixXd pt1(1, 3);
-        pt1 << x1, y1, z1;
-
-        // the second one
-        double x2 = point_A(0, 0) + d2*(point_B(0, 0) - point_A(0, 0));
-        double y2 = point_A(0, 1) + d2*(point_B(0, 1) - point_A(0, 1));
-        double z2 = point_A(0, 2) + d2*(point_B(0, 2) - point_A(0, 2));
-        MatrixXd pt2(1, 3);
-        pt2 << x2, y2, z2;
+        double d1 = (-b + sqrt(delta)) / (2*a);
+        double d2 = (-b - sqrt(delta)) / (2*a);
+        RowVector3d pt1 = point_A + d1*dir;
+        RowVector3d pt2 = point_A + d2*dir;
 
         if (isBetween(pt1, point_A, point_B)) {
-            intersections.push_back(pt1);
+            intersections[num_of_intersections] = pt1;
+            num_of_intersections += 1;
         }
         if (isBetween(pt2, point_A, point_B)) {
-            intersections.push_back(pt2);
+            intersections[num_of_intersections] = pt2;
+            num_of_intersections += 1;
         }
     }
     else {
         // one solution
-        d1 = -b / (2*a);
-        double x1 = point_A(0, 0) + d1*(point_B(0, 0) - point_A(0, 0));
-        double y1 = point_A(0, 1) + d1*(point_B(0, 1) - point_A(0, 1));
-        double z1 = point_A(0, 2) + d1*(point_B(0, 2) - point_A(0, 2));
-        MatrixXd pt1(1, 3);
-        pt1 << x1, y1, z1;
+        RowVector3d pt1 = point_A + (-b / (2*a))*dir;
 
         if (isBetween(pt1, point_A, point_B)) {
-            intersections.push_back(pt1);
+            intersections[num_of_intersections] = pt1;
+            num_of_intersections += 1;
         }
     }
-    
-    return intersections;
+
+    return num_of_intersections;
 }
 
-std::tuple<MatrixXd, MatrixXd, double> shortest_dist_between_lines (MatrixXd a0, MatrixXd a1, MatrixXd b0, MatrixXd b1, bool clamp) {
-    MatrixXd A = a1 - a0;
-    MatrixXd B = b1 - b0;
-    MatrixXd A_normalized = A / A.norm();
-    MatrixXd B_normalized = B / B.norm();
+std::tuple<RowVector3d, RowVector3d, double> shortest_dist_between_lines (const Ref<const RowVector3d>& a0, const Ref<const RowVector3d>& a1,
+                                                                          const Ref<const RowVector3d>& b0, const Ref<const RowVector3d>& b1, bool clamp) {
+    RowVector3d A = a1 - a0;
+    RowVector3d B = b1 - b0;
+    RowVector3d A_normalized = A / A.norm();
+    RowVector3d B_normalized = B / B.norm();
 
-    MatrixXd cross = cross_product(A_normalized, B_normalized);
+    RowVector3d cross = cross_product(A_normalized, B_normalized);
     double denom = cross.squaredNorm();
 
     // If lines are parallel (denom=0) test if lines overlap.
@@ -283,41 +240,41 @@ std::tuple<MatrixXd, MatrixXd, double> shortest_dist_between_lines (MatrixXd a0,
         }
 
         // Segments overlap, return distance between parallel segments
-        return {MatrixXd::Zero(1, 3), MatrixXd::Zero(1, 3), (d0*A_normalized+a0-b0).norm()};
+        return {RowVector3d::Zero(), RowVector3d::Zero(), (d0*A_normalized+a0-b0).norm()};
     }
 
     // Lines criss-cross: Calculate the projected closest points
-    MatrixXd t = b0 - a0;
-    MatrixXd tempA = MatrixXd::Zero(3, 3);
-    tempA.block(0, 0, 1, 3) = t;
-    tempA.block(1, 0, 1, 3) = B_normalized;
-    tempA.block(2, 0, 1, 3) = cross;
+    RowVector3d t = b0 - a0;
+    Eigen::Matrix3d tempA;
+    tempA.row(0) = t;
+    tempA.row(1) = B_normalized;
+    tempA.row(2) = cross;
 
-    MatrixXd tempB = MatrixXd::Zero(3, 3);
-    tempB.block(0, 0, 1, 3) = t;
-    tempB.block(1, 0, 1, 3) = A_normalized;
-    tempB.block(2, 0, 1, 3) = cross;
+    Eigen::Matrix3d tempB;
+    tempB.row(0) = t;
+    tempB.row(1) = A_normalized;
+    tempB.row(2) = cross;
 
     double t0 = tempA.determinant() / denom;
     double t1 = tempB.determinant() / denom;
 
-    MatrixXd pA = a0 + (A_normalized * t0);  // projected closest point on segment A
-    MatrixXd pB = b0 + (B_normalized * t1);  // projected closest point on segment B
+    RowVector3d pA = a0 + (A_normalized * t0);  // projected closest point on segment A
+    RowVector3d pB = b0 + (B_normalized * t1);  // projected closest point on segment B
 
     // clamp
     if (clamp) {
         if (t0 < 0) {
-            pA = a0.replicate(1, 1);
+            pA = a0;
         }
         else if (t0 > A.norm()) {
-            pA = a1.replicate(1, 1);
+            pA = a1;
         }
 
         if (t1 < 0) {
-            pB = b0.replicate(1, 1);
+            pB = b0;
         }
         else if (t1 > B.norm()) {
-            pB = b1.replicate(1, 1);
+            pB = b1;
         }
 
         // clamp projection A
@@ -1022,18 +979,4 @@ visualization_msgs::MarkerArray MatrixXd2MarkerArray (std::vector<MatrixXd> Y,
     }
 
     return results;
-}
-
-MatrixXd cross_product (MatrixXd vec1, MatrixXd vec2) {
-    MatrixXd ret = MatrixXd::Zero(1, 3);
-    
-    ret(0, 0) = vec1(0, 1)*vec2(0, 2) - vec1(0, 2)*vec2(0, 1);
-    ret(0, 1) = -(vec1(0, 0)*vec2(0, 2) - vec1(0, 2)*vec2(0, 0));
-    ret(0, 2) = vec1(0, 0)*vec2(0, 1) - vec1(0, 1)*vec2(0, 0);
-
-    return ret;
-}
-
-double dot_product (MatrixXd vec1, MatrixXd vec2) {
-    return vec1(0, 0)*vec2(0, 0) + vec1(0, 1)*vec2(0, 1) + vec1(0, 2)*vec2(0, 2);
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include "../include/visibility_checker.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+using Eigen::MatrixXd;
+
+// projected pixel coordinates are limited to this many pixels around the image origin, far beyond
+// any real image, so they always fit an int (a node just in front of the camera projects very far out)
+static const double MAX_PIXEL_COORD = 1 << 20;
+
+static inline double clamp_pixel (double p) {
+    return std::min(std::max(p, -MAX_PIXEL_COORD), MAX_PIXEL_COORD);
+}
+
+// out-of-class definitions, needed when the states are bound to a reference (e.g. std::vector's fill constructor)
+const int visibility_checker::VISIBLE;
+const int visibility_checker::OCCLUDED;
+const int visibility_checker::MISSING;
+
+visibility_checker::visibility_checker () {
+    nodes_per_dlo_ = 1;
+    half_width_sq_ = 0;
+}
+
+visibility_checker::visibility_checker (MatrixXd proj_matrix, int nodes_per_dlo, int dlo_pixel_width) {
+    proj_matrix_ = proj_matrix;
+    nodes_per_dlo_ = nodes_per_dlo;
+    half_width_sq_ = 0.25 * dlo_pixel_width * dlo_pixel_width;
+}
+
+void visibility_checker::project_nodes (const MatrixXd& Y) {
+    node_cols_.resize(Y.rows());
+    node_rows_.resize(Y.rows());
+    node_depths_.resize(Y.rows());
+    node_valid_.resize(Y.rows());
+    for (int i = 0; i < Y.rows(); i ++) {
+        double u = proj_matrix_(0, 0)*Y(i, 0) + proj_matrix_(0, 1)*Y(i, 1) + proj_matrix_(0, 2)*Y(i, 2) + proj_matrix_(0, 3);
+        double v = proj_matrix_(1, 0)*Y(i, 0) + proj_matrix_(1, 1)*Y(i, 1) + proj_matrix_(1, 2)*Y(i, 2) + proj_matrix_(1, 3);
+        double w = proj_matrix_(2, 0)*Y(i, 0) + proj_matrix_(2, 1)*Y(i, 1) + proj_matrix_(2, 2)*Y(i, 2) + proj_matrix_(2, 3);
+        node_depths_[i] = w;
+
+        // on or behind the camera plane (or not a finite position): there is no pixel
+        node_valid_[i] = (w > 0 && std::isfinite(u / w) && std::isfinite(v / w));
+        if (!node_valid_[i]) {
+            node_cols_[i] = -1;
+            node_rows_[i] = -1;
+            continue;
+        }
+        node_cols_[i] = static_cast<int>(clamp_pixel(u / w));
+        node_rows_[i] = static_cast<int>(clamp_pixel(v / w));
+    }
+}
+
+std::vector<bool> visibility_checker::get_self_unoccluded_nodes (const MatrixXd& Y) {
+    int M = Y.rows();
+    project_nodes(Y);
+
+    // sort edges based on how far away they are from the camera
+    std::vector<double> averaged_node_camera_dists = {};
+    std::vector<int> indices_vec = {};
+    for (int i = 0; i < M-1; i ++) {
+        double dist = ((Y.row(i) + Y.row(i+1)) / 2).norm();
+        // keeps the ordering strict if a node is not finite
+        averaged_node_camera_dists.push_back(std::isfinite(dist) ? dist : std::numeric_limits<double>::infinity());
+        indices_vec.push_back(i);
+    }
+    std::sort(indices_vec.begin(), indices_vec.end(),
+        [&](const int& a, const int& b) {
+            return (averaged_node_camera_dists[a] < averaged_node_camera_dists[b]);
+        }
+    );
+
+    std::vector<bool> unoccluded(M, false);
+    std::vector<int> drawn_edges = {};
+    drawn_edges.reserve(M);
+
+    // is the pixel of node i inside any of the edges drawn so far
+    auto covered = [&](int i) {
+        double px = node_cols_[i];
+        double py = node_rows_[i];
+        for (int e : drawn_edges) {
+            double ax = node_cols_[e], ay = node_rows_[e];
+            double bx = node_cols_[e+1], by = node_rows_[e+1];
+            double dx = bx - ax, dy = by - ay;
+            double len_sq = dx*dx + dy*dy;
+            double t = (len_sq > 0) ? ((px - ax)*dx + (py - ay)*dy) / len_sq : 0;
+            t = std::min(1.0, std::max(0.0, t));
+            double ex = ax + t*dx - px;
+            double ey = ay + t*dy - py;
+            if (ex*ex + ey*ey <= half_width_sq_) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // edges closest to the camera first
+    for (int idx : indices_vec) {
+        // no edge between the last node of a dlo and the first node of the next
+        if ((idx + 1) % nodes_per_dlo_ == 0) {
+            continue;
+        }
+        // nodes without a pixel are skipped, and so are the edges they are on
+        if (node_valid_[idx] && !unoccluded[idx] && !covered(idx)) {
+            unoccluded[idx] = true;
+        }
+        if (node_valid_[idx+1] && !unoccluded[idx+1] && !covered(idx+1)) {
+            unoccluded[idx+1] = true;
+        }
+        if (node_valid_[idx] && node_valid_[idx+1]) {
+            drawn_edges.push_back(idx);
+        }
+    }
+
+    return unoccluded;
+}
+
+std::vector<int> visibility_checker::classify_by_depth (const MatrixXd& Y, const Mat& depth, double depth_tolerance, int window_radius) {
+    int M = Y.rows();
+    project_nodes(Y);
+
+    std::vector<int> states(M, MISSING);
+    for (int i = 0; i < M; i ++) {
+        int row = node_rows_[i];
+        int col = node_cols_[i];
+        if (!node_valid_[i] || row < 0 || row >= depth.rows || col < 0 || col >= depth.cols) {
+            continue;
+        }
+
+        // depth image is in millimeters
+        double node_depth = node_depths_[i] * 1000.0;
+        double tolerance = depth_tolerance * 1000.0;
+        int num_of_samples = 0;
+        int num_in_front = 0;
+        bool matched = false;
+        for (int r = std::max(0, row - window_radius); r <= std::min(depth.rows - 1, row + window_radius) && !matched; r ++) {
+            const uint16_t* depth_row = depth.ptr<uint16_t>(r);
+            for (int c = std::max(0, col - window_radius); c <= std::min(depth.cols - 1, col + window_radius); c ++) {
+                // zero means no measurement
+                if (depth_row[c] == 0) {
+                    continue;
+                }
+                num_of_samples += 1;
+                if (std::abs(depth_row[c] - node_depth) <= tolerance) {
+                    matched = true;
+                    break;
+                }
+                if (depth_row[c] < node_depth - tolerance) {
+                    num_in_front += 1;
+                }
+            }
+        }
+
+        if (matched) {
+            states[i] = VISIBLE;
+        }
+        else if (num_of_samples > 0 && 2*num_in_front > num_of_samples) {
+            states[i] = OCCLUDED;
+        }
+    }
+
+    return states;
+}
+
+bool visibility_checker::has_projection (int i) const {
+    return i >= 0 && i < node_valid_.size() && node_valid_[i];
+}
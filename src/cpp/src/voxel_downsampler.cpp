@@ -0,0 +1,142 @@
+#include "../include/voxel_downsampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+using Eigen::MatrixXd;
+using Eigen::Matrix3Xf;
+using Eigen::Matrix3Xd;
+
+static const uint64_t EMPTY_KEY = UINT64_MAX;
+
+// voxel indices are packed into 21 bits per axis, i.e. +/- 2^20 voxels around the camera
+static const int64_t INDEX_OFFSET = int64_t(1) << 20;
+static const uint64_t INDEX_MASK = (uint64_t(1) << 21) - 1;
+
+static inline uint64_t hash_key (uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+voxel_downsampler::voxel_downsampler () {
+    leaf_size_ = 0;
+    inverse_leaf_size_ = 0;
+    capacity_mask_ = 0;
+    num_of_voxels_ = 0;
+}
+
+voxel_downsampler::voxel_downsampler (double leaf_size) {
+    leaf_size_ = leaf_size;
+    inverse_leaf_size_ = (leaf_size > 0) ? 1.0 / leaf_size : 0;
+    capacity_mask_ = 0;
+    num_of_voxels_ = 0;
+}
+
+double voxel_downsampler::get_leaf_size () {
+    return leaf_size_;
+}
+
+void voxel_downsampler::reset (int num_of_pts) {
+    // keep the load factor at or below 0.5
+    uint64_t capacity = 16;
+    while (capacity < 2 * static_cast<uint64_t>(num_of_pts)) {
+        capacity <<= 1;
+    }
+    if (keys_.size() < capacity) {
+        keys_.resize(capacity);
+        slots_.resize(capacity);
+    }
+    capacity_mask_ = capacity - 1;
+    std::fill(keys_.begin(), keys_.begin() + capacity, EMPTY_KEY);
+
+    if (sums_.size() < 4 * static_cast<size_t>(num_of_pts)) {
+        sums_.resize(4 * static_cast<size_t>(num_of_pts));
+    }
+    num_of_voxels_ = 0;
+}
+
+int voxel_downsampler::insert (double x, double y, double z) {
+    uint64_t ix = static_cast<uint64_t>(static_cast<int64_t>(std::floor(x * inverse_leaf_size_)) + INDEX_OFFSET) & INDEX_MASK;
+    uint64_t iy = static_cast<uint64_t>(static_cast<int64_t>(std::floor(y * inverse_leaf_size_)) + INDEX_OFFSET) & INDEX_MASK;
+    uint64_t iz = static_cast<uint64_t>(static_cast<int64_t>(std::floor(z * inverse_leaf_size_)) + INDEX_OFFSET) & INDEX_MASK;
+    uint64_t key = ix | (iy << 21) | (iz << 42);
+
+    // linear probing
+    uint64_t h = hash_key(key) & capacity_mask_;
+    while (keys_[h] != key) {
+        if (keys_[h] == EMPTY_KEY) {
+            keys_[h] = key;
+            slots_[h] = num_of_voxels_;
+            std::fill(sums_.begin() + 4*num_of_voxels_, sums_.begin() + 4*num_of_voxels_ + 4, 0.0);
+            num_of_voxels_ += 1;
+            break;
+        }
+        h = (h + 1) & capacity_mask_;
+    }
+
+    double* sum = sums_.data() + 4*slots_[h];
+    sum[0] += x;
+    sum[1] += y;
+    sum[2] += z;
+    sum[3] += 1;
+    return slots_[h];
+}
+
+MatrixXd voxel_downsampler::collect () {
+    MatrixXd X(num_of_voxels_, 3);
+    for (int i = 0; i < num_of_voxels_; i ++) {
+        const double* sum = sums_.data() + 4*i;
+        X(i, 0) = sum[0] / sum[3];
+        X(i, 1) = sum[1] / sum[3];
+        X(i, 2) = sum[2] / sum[3];
+    }
+    return X;
+}
+
+MatrixXd voxel_downsampler::downsample (const Matrix3Xf& pts, int num_of_pts) {
+    // no downsampling requested
+    if (leaf_size_ <= 0) {
+        return pts.leftCols(num_of_pts).transpose().cast<double>();
+    }
+
+    reset(num_of_pts);
+    for (int n = 0; n < num_of_pts; n ++) {
+        insert(pts(0, n), pts(1, n), pts(2, n));
+    }
+    return collect();
+}
+
+MatrixXd voxel_downsampler::downsample (const Matrix3Xf& pts, int num_of_pts, const std::vector<uint8_t>& labels, std::vector<int>& voxel_labels) {
+    if (leaf_size_ <= 0) {
+        voxel_labels.assign(labels.begin(), labels.begin() + num_of_pts);
+        return pts.leftCols(num_of_pts).transpose().cast<double>();
+    }
+
+    reset(num_of_pts);
+    voxel_labels.clear();
+    for (int n = 0; n < num_of_pts; n ++) {
+        int voxel = insert(pts(0, n), pts(1, n), pts(2, n));
+        // a new voxel is always appended at the end
+        if (voxel == voxel_labels.size()) {
+            voxel_labels.push_back(labels[n]);
+        }
+    }
+    return collect();
+}
+
+MatrixXd voxel_downsampler::downsample (const Matrix3Xd& pts) {
+    if (leaf_size_ <= 0) {
+        return pts.transpose();
+    }
+
+    reset(pts.cols());
+    for (int n = 0; n < pts.cols(); n ++) {
+        insert(pts(0, n), pts(1, n), pts(2, n));
+    }
+    return collect();
+}